@@ -1,34 +1,200 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include "c3bt.h"
+#ifdef C3BT_WITH_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 void print_stats(c3bt_tree* tree)
 {
-    printf("%d uobjs in %d cells, %d pushdowns %d splits %d pushups "
+    printf("%zu uobjs in %d cells, %d pushdowns %d splits %d pushups "
         "%d merges.\n", c3bt_nobjects(tree), c3bt_stat_cells,
         c3bt_stat_pushdowns, c3bt_stat_splits, c3bt_stat_pushups,
         c3bt_stat_merges);
 }
 
+void print_lookup_stats(c3bt_tree* tree)
+{
+    printf("%dB cells, %.2fB/uobj", C3BT_CELL_SIZE,
+        (double)c3bt_stat_cells * C3BT_CELL_SIZE / c3bt_nobjects(tree));
+#ifdef C3BT_LOOKUP_STATS
+    printf(", %.2f cells/lookup, %.2f lines/lookup",
+        (double)c3bt_stat_lookup_cells / c3bt_stat_lookups,
+        (double)c3bt_stat_lookup_lines / c3bt_stat_lookups);
+#endif
+    printf(".\n");
+}
+
 void clear_stats()
 {
     c3bt_stat_pushdowns = 0;
     c3bt_stat_splits = 0;
     c3bt_stat_pushups = 0;
     c3bt_stat_merges = 0;
+#ifdef C3BT_LOOKUP_STATS
+    c3bt_stat_lookups = 0;
+    c3bt_stat_lookup_cells = 0;
+    c3bt_stat_lookup_lines = 0;
+#endif
+}
+
+#define ASIZE   100000
+
+#ifdef C3BT_WITH_THREADS
+typedef struct reader {
+    c3bt_tree *tree;
+    int *array;
+    volatile int *stop;
+    long lookups;
+    pthread_t tid;
+    int id;
+    int reserved;
+} reader;
+
+/* Look up the array in read-side sections of 64 keys until stopped. */
+void *reader_main(void *arg)
+{
+    reader *r = arg;
+    int i = r->id * 7919 % ASIZE, n;
+
+    while (!*r->stop) {
+        c3bt_read_lock(r->tree, r->id);
+        for (n = 0; n < 64; n++, i = (i + 1) % ASIZE)
+            c3bt_find_u32(r->tree, r->array[i]);
+        c3bt_read_unlock(r->tree, r->id);
+        r->lookups += 64;
+    }
+    return NULL;
+}
+
+typedef struct writer {
+    c3bt_tree *tree;
+    int *array;
+    pthread_mutex_t *lock;
+    c3bt_combiner *fc;
+    char *kept; /* by the checkers. */
+    long failed;
+    pthread_t tid;
+    int id;
+    int nwriters;
+} writer;
+
+/*
+ * Add, then remove, every nwriters-th uobj of the array; under the lock with
+ * c3bt_add/remove() if there's one, through the combiner if there's one, else
+ * with c3bt_add/remove_mt().
+ */
+void *writer_main(void *arg)
+{
+    writer *w = arg;
+    int i;
+
+    for (i = w->id; i < ASIZE; i += w->nwriters) {
+        if (w->lock) {
+            pthread_mutex_lock(w->lock);
+            c3bt_add(w->tree, w->array + i);
+            pthread_mutex_unlock(w->lock);
+        } else if (w->fc) {
+            c3bt_combine_add(w->fc, w->array + i, w->id);
+        } else {
+            c3bt_add_mt(w->tree, w->array + i, w->id);
+        }
+    }
+    for (i = w->id; i < ASIZE; i += w->nwriters) {
+        if (w->lock) {
+            pthread_mutex_lock(w->lock);
+            c3bt_remove(w->tree, w->array + i);
+            pthread_mutex_unlock(w->lock);
+        } else if (w->fc) {
+            c3bt_combine_remove(w->fc, w->array + i, w->id);
+        } else {
+            c3bt_remove_mt(w->tree, w->array + i, w->id);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add and remove random ones of every nwriters-th uobj of the array with
+ * c3bt_add/remove_mt(), ending with those kept.  The keys are the writer's
+ * own, so every change must take.
+ */
+void *checker_main(void *arg)
+{
+    writer *w = arg;
+    unsigned seed = w->id + 1;
+    int i, n;
+
+    for (n = 0; n < ASIZE * 4 / w->nwriters; n++) {
+        i = rand_r(&seed) % (ASIZE / w->nwriters) * w->nwriters + w->id;
+        if (w->kept[i] ? !c3bt_remove_mt(w->tree, w->array + i, w->id)
+            : !c3bt_add_mt(w->tree, w->array + i, w->id))
+            w->failed++;
+        w->kept[i] = !w->kept[i];
+    }
+    return NULL;
+}
+
+/* Run the writers on the tree; return the time taken in us. */
+long run_writers(writer *writers, int nwriters, c3bt_tree *tree, int *array,
+    pthread_mutex_t *lock, c3bt_combiner *fc)
+{
+    struct timespec t_start, t_end;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < nwriters; i++) {
+        writers[i].tree = tree;
+        writers[i].array = array;
+        writers[i].lock = lock;
+        writers[i].fc = fc;
+        writers[i].id = i;
+        writers[i].nwriters = nwriters;
+        pthread_create(&writers[i].tid, NULL, writer_main, writers + i);
+    }
+    for (i = 0; i < nwriters; i++)
+        pthread_join(writers[i].tid, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    return (t_end.tv_sec - t_start.tv_sec) * 1000000
+        + (t_end.tv_nsec - t_start.tv_nsec) / 1000;
 }
+#endif
 
 int main()
 {
-#define ASIZE   100000
     c3bt_tree tree;
     c3bt_cursor cur;
-    int i;
+    int i, j;
     int *array = malloc(ASIZE * sizeof(int));
+    void **uobjs = malloc(ASIZE * sizeof(void*));
+    void **robjs = malloc(ASIZE * sizeof(void*));
     int *robj;
     struct timespec t_start, t_end;
+#ifdef C3BT_WITH_STRING
+    c3bt_range range;
+    char **paths, **urls, prefix[32];
+    int kdt;
+#endif
+#ifdef C3BT_WITH_THREADS
+    reader *readers;
+    writer *writers;
+    pthread_mutex_t lock;
+    volatile int stop;
+    c3bt_combiner *fc;
+    c3bt_replicated *replicated;
+    c3bt_tree *replica;
+    long lookups, t_mutex, t_mt, t_fc, failed;
+    int nreaders, nwriters;
+    c3bt_sharded *sharded;
+    c3bt_shard_cursor scur;
+    uint32_t *spread;
+    size_t added;
+    char *kept;
+#endif
 
 //    srand(time(NULL) - 1354856137);
 //    srand(77);
@@ -47,6 +213,34 @@ int main()
     print_stats(&tree);
     clear_stats();
 
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_find_u32(&tree, array[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Find %dk uobjs: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    print_lookup_stats(&tree);
+    clear_stats();
+
+    for (i = 0; i < ASIZE; i++)
+        uobjs[i] = array + i;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i += 64)
+        c3bt_find_batch(&tree, uobjs + i, ASIZE - i < 64 ? ASIZE - i : 64,
+            robjs + i);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Find %dk uobjs batched: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    c3bt_find_sorted(&tree, uobjs, ASIZE, robjs);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Find %dk uobjs sorted: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+
     clock_gettime(CLOCK_MONOTONIC, &t_start);
     for (i = 0; i < ASIZE; i += 2)
         c3bt_remove(&tree, array + i);
@@ -66,15 +260,328 @@ int main()
             + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
     print_stats(&tree);
 
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
     robj = c3bt_first(&tree, &cur);
     while (robj) {
         //printf("%d\n", *robj);
         robj = c3bt_next(&tree, &cur);
     }
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Scan %dk uobjs: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i++) {
+        j = array[i] + 1;
+        c3bt_lower_bound(&tree, &j, &cur);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Seek %dk keys: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    c3bt_relayout(&tree);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Relayout: %ldus\n",
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_find_u32(&tree, array[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Find %dk uobjs after relayout: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    robj = c3bt_first(&tree, &cur);
+    while (robj)
+        robj = c3bt_next(&tree, &cur);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Scan %dk uobjs after relayout: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
     c3bt_destroy(&tree);
     printf("Population distribution:\n");
     for (i = 0; i < NODES_PER_CELL; i++)
         printf("cells with %d nodes: %d\n", i + 1, c3bt_stat_popdist[i]);
+
+    /* The array is sorted already. */
+    for (i = 0; i < ASIZE; i++)
+        uobjs[i] = array + i;
+    c3bt_stat_cells = 0;
+    clear_stats();
+    c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    c3bt_build_sorted(&tree, uobjs, ASIZE);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Build %dk uobjs sorted: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    print_stats(&tree);
+    clear_stats();
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_find_u32(&tree, array[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Find %dk uobjs: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    print_lookup_stats(&tree);
+    c3bt_destroy(&tree);
+
+    /* Shuffled, then built on all CPUs. */
+    for (i = ASIZE - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        robj = uobjs[i];
+        uobjs[i] = uobjs[j];
+        uobjs[j] = robj;
+    }
+    c3bt_stat_cells = 0;
+    clear_stats();
+    c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    c3bt_build(&tree, uobjs, ASIZE, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Build %dk uobjs unsorted: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    print_stats(&tree);
+    c3bt_destroy(&tree);
+
+#ifdef C3BT_WITH_THREADS
+    /* Readers on the other CPUs look up while the writer changes the tree. */
+    nreaders = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (nreaders < 1)
+        nreaders = 1;
+    readers = calloc(nreaders, sizeof(reader));
+    c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+    c3bt_rcu_enable(&tree, nreaders);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_add(&tree, array + i);
+    stop = 0;
+    for (i = 0; i < nreaders; i++) {
+        readers[i].tree = &tree;
+        readers[i].array = array;
+        readers[i].stop = &stop;
+        readers[i].id = i;
+        pthread_create(&readers[i].tid, NULL, reader_main, readers + i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i += 2)
+        c3bt_remove(&tree, array + i);
+    for (i = 0; i < ASIZE; i += 2)
+        c3bt_add(&tree, array + i);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    stop = 1;
+    lookups = 0;
+    for (i = 0; i < nreaders; i++) {
+        pthread_join(readers[i].tid, NULL);
+        lookups += readers[i].lookups;
+    }
+    printf("Remove and re-add %dk uobjs with %d readers: %ldus, %ldk lookups\n",
+        ASIZE / 2000, nreaders,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000, lookups / 1000);
+    c3bt_destroy(&tree);
+    free(readers);
+
+    /* Writers on all CPUs: one big lock vs. c3bt_add/remove_mt(). */
+    nwriters = nreaders + 1;
+    writers = calloc(nwriters, sizeof(writer));
+    pthread_mutex_init(&lock, NULL);
+    c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+    t_mutex = run_writers(writers, nwriters, &tree, array, &lock, NULL);
+    c3bt_destroy(&tree);
+    pthread_mutex_destroy(&lock);
+    c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+    c3bt_rcu_enable(&tree, 1);
+    c3bt_rcu_writers(&tree, nwriters);
+    t_mt = run_writers(writers, nwriters, &tree, array, NULL, NULL);
+    printf("Add and remove %dk uobjs with %d writers: %ldus locked, "
+        "%ldus mt\n", ASIZE / 1000, nwriters, t_mutex, t_mt);
+    c3bt_destroy(&tree);
+
+    /* The same writers checked: every change, the count and the order. */
+    kept = calloc(ASIZE, 1);
+    c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+    c3bt_rcu_enable(&tree, 1);
+    c3bt_rcu_writers(&tree, nwriters);
+    for (i = 0; i < nwriters; i++) {
+        writers[i].tree = &tree;
+        writers[i].array = array;
+        writers[i].kept = kept;
+        writers[i].failed = 0;
+        writers[i].id = i;
+        writers[i].nwriters = nwriters;
+        pthread_create(&writers[i].tid, NULL, checker_main, writers + i);
+    }
+    failed = 0;
+    for (i = 0; i < nwriters; i++) {
+        pthread_join(writers[i].tid, NULL);
+        failed += writers[i].failed;
+    }
+    robj = c3bt_first(&tree, &cur);
+    for (i = j = 0; i < ASIZE; i++) {
+        if (!kept[i])
+            continue;
+        if (robj != array + i)
+            break;
+        robj = c3bt_next(&tree, &cur);
+        j++;
+    }
+    printf("Add and remove %dk uobjs with %d writers checked: %ld failed, "
+        "%zu of %d left %s\n", ASIZE / 1000, nwriters, failed,
+        c3bt_nobjects(&tree), j, i == ASIZE && !robj ? "in order"
+            : "out of order");
+    c3bt_destroy(&tree);
+    free(kept);
+    free(writers);
+
+    /* 1 to 64 writers: one big lock vs. flat combining. */
+    writers = calloc(64, sizeof(writer));
+    for (nwriters = 1; nwriters <= 64; nwriters *= 2) {
+        pthread_mutex_init(&lock, NULL);
+        c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+        t_mutex = run_writers(writers, nwriters, &tree, array, &lock, NULL);
+        c3bt_destroy(&tree);
+        pthread_mutex_destroy(&lock);
+        c3bt_init(&tree, C3BT_KDT_U32, 0, 0);
+        fc = c3bt_combiner_new(&tree, nwriters);
+        t_fc = run_writers(writers, nwriters, &tree, array, NULL, fc);
+        c3bt_combiner_free(fc);
+        c3bt_destroy(&tree);
+        printf("Add and remove %dk uobjs with %d writers: %.1fM ops/s "
+            "locked, %.1fM ops/s combined\n", ASIZE / 1000, nwriters,
+            2.0 * ASIZE / t_mutex, 2.0 * ASIZE / t_fc);
+    }
+    free(writers);
+
+    /* 16 shards on the top 4 key bits, so the keys must use them all. */
+    spread = malloc(ASIZE * sizeof(uint32_t));
+    for (i = 0; i < ASIZE; i++) {
+        spread[i] = i * 2654435761u;
+        uobjs[i] = spread + i;
+    }
+    sharded = c3bt_sharded_new(C3BT_KDT_U32, 0, 0, 4);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    added = c3bt_sharded_add_batch(sharded, uobjs, ASIZE, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Add %zuk uobjs to 16 shards in a batch: %ldus\n", added / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    robj = c3bt_sharded_first(sharded, &scur);
+    while (robj)
+        robj = c3bt_sharded_next(sharded, &scur);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Scan %zuk uobjs across the shards: %ldus\n",
+        c3bt_sharded_nobjects(sharded) / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    c3bt_sharded_free(sharded);
+    free(spread);
+
+    /* A replica per NUMA node; lookups go to the local one. */
+    replicated = c3bt_replicated_new(C3BT_KDT_U32, 0, 0, 0, 1, false);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_replicated_add(replicated, array + i);
+    c3bt_replicated_sync(replicated);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Add %dk uobjs to %d replicas: %ldus\n", ASIZE / 1000,
+        c3bt_replicated_nreplicas(replicated),
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    replica = c3bt_replicated_read_lock(replicated, 0, -1);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_find_u32(replica, array[i]);
+    c3bt_replicated_read_unlock(replicated, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Find %dk uobjs in the local replica: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    c3bt_replicated_free(replicated);
+#endif
+
+#ifdef C3BT_WITH_STRING
+    /* Path-like string keys, enumerated by directory, by pointer and
+     * in place. */
+    paths = malloc(ASIZE * sizeof(char*));
+    for (i = 0; i < ASIZE; i++) {
+        paths[i] = malloc(32);
+        snprintf(paths[i], 32, "/srv/%02d/%06d.dat", i % 64, i);
+    }
+    for (kdt = C3BT_KDT_PSTR; kdt <= C3BT_KDT_STR; kdt++) {
+        c3bt_init(&tree, kdt, 0, 0);
+        for (i = 0; i < ASIZE; i++)
+            c3bt_add(&tree, kdt == C3BT_KDT_STR ? (void*)paths[i]
+                : (void*)(paths + i));
+        clock_gettime(CLOCK_MONOTONIC, &t_start);
+        for (i = j = 0; i < 64; i++) {
+            snprintf(prefix, sizeof(prefix), "/srv/%02d/", i);
+            robjs[0] = prefix;
+            robj = c3bt_prefix_first(&tree, kdt == C3BT_KDT_STR ? (void*)prefix
+                : (void*)robjs, strlen(prefix) * 8, &range);
+            while (robj) {
+                j++;
+                robj = c3bt_range_next(&tree, &range);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t_end);
+        printf("Prefix scan %dk %s keys in 64 dirs: %ldus (%d found)\n",
+            ASIZE / 1000, kdt == C3BT_KDT_STR ? "STR" : "PSTR",
+            (t_end.tv_sec - t_start.tv_sec) * 1000000
+                + (t_end.tv_nsec - t_start.tv_nsec) / 1000, j);
+        c3bt_destroy(&tree);
+    }
+    for (i = 0; i < ASIZE; i++)
+        free(paths[i]);
+    free(paths);
+
+    /* URL-like string keys, 100+ bytes long, by pointer. */
+    urls = malloc(ASIZE * sizeof(char*));
+    for (i = 0; i < ASIZE; i++) {
+        urls[i] = malloc(128);
+        snprintf(urls[i], 128, "https://www.example.com/%08x/static/assets/"
+            "images/thumbnails/large/%06d.jpeg?width=1024&height=768",
+            i * 2654435761u, i);
+    }
+    c3bt_init(&tree, C3BT_KDT_PSTR, 0, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_add(&tree, urls + i);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Add %dk %zuB strings: %ldus\n", ASIZE / 1000, strlen(urls[0]),
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < ASIZE; i++)
+        c3bt_find_str(&tree, urls[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Find %dk strings: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    robj = c3bt_first(&tree, &cur);
+    while (robj)
+        robj = c3bt_next(&tree, &cur);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    printf("Scan %dk strings: %ldus\n", ASIZE / 1000,
+        (t_end.tv_sec - t_start.tv_sec) * 1000000
+            + (t_end.tv_nsec - t_start.tv_nsec) / 1000);
+    c3bt_destroy(&tree);
+    for (i = 0; i < ASIZE; i++)
+        free(urls[i]);
+    free(urls);
+#endif
+    free(uobjs);
+    free(robjs);
     free(array);
     return 0;
 }
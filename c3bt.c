@@ -12,6 +12,7 @@
  *      incorporates it.
  */
 
+#define _GNU_SOURCE /* for CPU affinity. */
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,18 +21,31 @@
 #error "GCC IS REQUIRED."
 #endif
 
-#ifdef _LP64
-#error "64-BIT NOT IMPLEMENTED."
-#endif
-
 #include "c3bt.h"
 
+/* Depending on the options in c3bt.h. */
+#if defined(C3BT_COMPRESSED) || defined(C3BT_HUGEPAGE)
+#include <sys/mman.h>
+#endif
+#if (defined(C3BT_SOA) && defined(__SSE2__)) || defined(__x86_64__) \
+    || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef C3BT_WITH_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
 #define _likely(x)      __builtin_expect((x), 1)
 #define _unlikely(x)    __builtin_expect((x), 0)
 #define _compact        __attribute__((packed))
 #define _inline         __attribute__((always_inline, unused))
 #define _noinline       __attribute__((noinline, noclone))
 #define _osize          __attribute__((optimize("Os")))
+/* Reads past the end of a string, but never across a page. */
+#define _overread       __attribute__((no_sanitize_address))
 #define CT_ASSERT(x)    switch(0) {case 0: case(x): ;}
 
 /*
@@ -44,14 +58,27 @@
  *      cell.  A special value, 0x3F, is used to mark an unoccupied node slot.
  *
  * The differing bit number (crit-bit) is stored in a byte, so keys can be
- * indexed up to 256 bits in the standard LP32 layout.
+ * indexed up to 256 bits in the standard LP32 layout.  LP64 layout uses 16-bit
+ * crit-bit numbers for keys up to 64K bits.
  */
+#ifdef C3BT_WIDE_CELL
+typedef uint16_t c3bt_cbit;
+#else
+typedef uint8_t c3bt_cbit;
+#endif
+
 typedef struct c3bt_node {
-    uint8_t cbit;
+    c3bt_cbit cbit;
     uint8_t child[2];
 } c3bt_node;
 
+#ifdef C3BT_WIDE_CELL
+#define CBIT_MAX            65535
+#else
 #define CBIT_MAX            255
+#endif
+/* HSTR keys: the head bytes as-is, then a 64-bit hash of the rest. */
+#define HSTR_HEAD           ((CBIT_MAX + 1) / 8 - 8)
 #define INVALID_NODE        0x3F
 #define CHILD_IS_NODE(x)    ((unsigned)(x) < NODES_PER_CELL)
 #define CHILD_CELL_BIT      0x40
@@ -64,42 +91,158 @@ typedef struct c3bt_node {
 /*
  * Each C3BT cell is 64B under standard LP32 layout.
  *
- * Cell must be 8B-aligned to spare 3 low bits as node count.  This is already
- * satisfied by major platforms and C libraries but users of custom allocators
- * shall double check.
+ * Cell must be 8B-aligned to spare 3 low bits as node count.  Cells come from
+ * per-tree slabs aligned to the cell size, so a cell never straddles two cache
+ * lines.
  *
  * Cell layout:
  *    - PNC (parent & node count), 4B, [0, 3]
  *    - Array of 8 crit-bit nodes, 24B, [4, 27]
  *    - Array of 9 external pointers, 36B, [28, 63]
  *
+ * The LP64 cell is 128B and must be 16B-aligned, as 4 low bits are needed to
+ * count up to 9 nodes:
+ *    - PNC, 8B, [0, 7]
+ *    - Array of 9 crit-bit nodes, 36B, [8, 43]
+ *    - Reserved, 4B, [44, 47]
+ *    - Array of 10 external pointers, 80B, [48, 127]
+ *
+ * With C3BT_BITMAP, the reserved bytes hold the node and pointer allocation
+ * bitmaps.  PNC is then a plain parent pointer and there's no alignment
+ * requirement.
+ *
+ * The compressed LP64 cell has the LP32 geometry, with 32-bit references in
+ * place of pointers (see c3bt_ref).
+ *
+ * With C3BT_SOA, the node array is stored as structure-of-arrays: all cbits,
+ * then all left children, then all right children.  Sizes are unchanged, but
+ * the children become packed bytes which SIMD can compare in one go.
+ *
  * Node[0] is always the root of the cell's subtree.
  */
 typedef struct c3bt_cell c3bt_cell;
 
+/*
+ * Reference to a cell or an user object, used for both PNC and P[].
+ *
+ * Normally it's just a pointer.  With C3BT_COMPRESSED, a cell reference is the
+ * cell's index in the tree's cell arena, and an uobj reference is its offset to
+ * the tree's uobj base, in 4B units.  Reference 0 is NULL.
+ */
+#ifdef C3BT_COMPRESSED
+typedef uint32_t c3bt_ref;
+#else
+typedef c3bt_cell *c3bt_ref;
+#endif
+
+#define NULL_REF            ((c3bt_ref)0)
+#define BUSY_REF            ((c3bt_ref)1)
+
 struct c3bt_cell {
-    c3bt_cell *pnc;
+    c3bt_ref pnc;
+#ifdef C3BT_SOA
+    c3bt_cbit cbit[NODES_PER_CELL];
+    uint8_t child[2][NODES_PER_CELL];
+#else
     c3bt_node N[NODES_PER_CELL];
-    c3bt_cell *P[NODES_PER_CELL + 1];
+#endif
+#if defined(C3BT_BITMAP)
+    uint16_t nmap; /* node allocation bitmap, bit n for N[n]. */
+    uint16_t pmap; /* pointer allocation bitmap, bit n for P[n]. */
+#elif defined(C3BT_WIDE_CELL)
+    uint32_t reserved;
+#endif
+    c3bt_ref P[NODES_PER_CELL + 1];
 };
 
+/* Node field access, independent of the node array layout. */
+#ifdef C3BT_SOA
+#define NODE_CBIT(cell, n)      ((cell)->cbit[n])
+#define NODE_CHILD(cell, n, c)  ((cell)->child[c][n])
+#else
+#define NODE_CBIT(cell, n)      ((cell)->N[n].cbit)
+#define NODE_CHILD(cell, n, c)  ((cell)->N[n].child[c])
+#endif
+
+#if defined(C3BT_BITMAP)
+#define PNC_MASK            0
+#elif defined(C3BT_WIDE_CELL)
+#define PNC_MASK            15
+#else
+#define PNC_MASK            7
+#endif
+
+#ifdef C3BT_COMPRESSED
+/*
+ * The arena is a virtual memory reservation aligned to its own size, so the
+ * arena base can be recovered from any cell in it.  PNC keeps 3 bits for the
+ * node count, which leaves 29 bits for the parent index.
+ */
+#define ARENA_BITS          (29 + 6)
+#define ARENA_MASK          (((uintptr_t)1 << ARENA_BITS) - 1)
+#define ARENA_CELLS         ((uint32_t)1 << (ARENA_BITS - 6))
+#define UOBJ_SHIFT          2
+#define UOBJ_WINDOW         ((uintptr_t)1 << (32 + UOBJ_SHIFT))
+#else
+/*
+ * Cells are carved from slabs which start small and double up to the maximum.
+ * Cell 0 of each slab is its header (see slab_head).  With C3BT_HUGEPAGE, a
+ * full-size slab is exactly one 2MB page.
+ */
+#define SLAB_MIN_CELLS      16
+#ifdef C3BT_HUGEPAGE
+#define SLAB_MAX_CELLS      (HUGEPAGE_SIZE / C3BT_CELL_SIZE)
+#else
+#define SLAB_MAX_CELLS      4096
+#endif
+#endif
+
+#ifdef C3BT_HUGEPAGE
+#define HUGEPAGE_SIZE       ((size_t)2 << 20)
+#endif
+
 /* The C3BT tree structure for implementation. */
 typedef struct c3bt_tree_impl {
     int (*bitops)(int, void *, void *); /* the bitops function. */
     c3bt_cell *root; /* the root cell. */
-    uint n_objects; /* number of user objects == number of nodes + 1. */
+    size_t n_objects; /* number of user objects == number of nodes + 1. */
     uint key_offset; /* offset to the key in the user object. */
-    uint16_t key_type; /* type of the key. */
-    uint16_t key_nbits; /* maximum number of bits of the key. */
+    uint key_type :8; /* type of the key. */
+    uint key_nbits :24; /* maximum number of bits of the key. */
+#ifdef C3BT_COMPRESSED
+    c3bt_cell *arena; /* the cell arena, allocated on demand. */
+    uintptr_t uobj_base; /* uobj references are relative to it. */
+    uint32_t arena_top; /* index of the first never-used cell. */
+    uint32_t arena_free; /* head of the free cell list, linked by PNC. */
+#else
+    c3bt_cell *slab; /* the current slab, allocated on demand. */
+    c3bt_cell *slab_free; /* head of the free cell list, linked by PNC. */
+    uint32_t slab_top; /* index of the first never-used cell in the slab. */
+    uint32_t slab_size; /* number of cells in the current slab. */
+#endif
+#ifdef C3BT_WITH_THREADS
+    struct rcu_state *rcu; /* concurrent readers, see c3bt_rcu_enable(). */
+#endif
 } c3bt_tree_impl;
 
+#ifndef C3BT_COMPRESSED
+typedef struct slab_head {
+    c3bt_cell *next; /* the previous slab. */
+    size_t ncells; /* number of cells in this slab, header included. */
+} slab_head;
+#endif
+
 typedef struct c3bt_cursor_impl {
     c3bt_cell *cell;
     int16_t nid; /* node index in cell. */
     int16_t cid; /* child index (0 or 1). */
+#ifdef _LP64
+    int16_t reserved[2];
+#endif
 } c3bt_cursor_impl;
 
 #ifdef C3BT_STATS
+/* Writers may run concurrently, so these are updated with relaxed atomics. */
 uint c3bt_stat_cells;
 uint c3bt_stat_pushdowns;
 uint c3bt_stat_splits;
@@ -107,19 +250,40 @@ uint c3bt_stat_pushups;
 uint c3bt_stat_merges;
 uint c3bt_stat_popdist[NODES_PER_CELL];
 #endif
+#ifdef C3BT_LOOKUP_STATS
+C3BT_STAT_TLS uint64_t c3bt_stat_lookups;
+C3BT_STAT_TLS uint64_t c3bt_stat_lookup_cells;
+C3BT_STAT_TLS uint64_t c3bt_stat_lookup_lines;
+#endif
 
 /* Standard bitops for common data types. */
 static int bitops_bits(int, void *, void *);
+static void crit_select(void);
 #ifdef C3BT_WITH_INTS
 static int bitops_u32(int, void *, void *);
 static int bitops_s32(int, void *, void *);
 static int bitops_u64(int, void *, void *);
 static int bitops_s64(int, void *, void *);
+static void lookup_int_select(void);
+#endif
+#ifdef C3BT_WITH_FLOATS
+static int bitops_f32(int, void *, void *);
+static int bitops_f64(int, void *, void *);
 #endif
 #ifdef C3BT_WITH_STRING
 static int bitops_str(int, void *, void *);
 static int bitops_pstr(int, void *, void *);
+static int bitops_blob(int, void *, void *);
+static int bitops_hstr(int, void *, void *);
+static int bitops_phstr(int, void *, void *);
 #endif
+#ifdef C3BT_WITH_LPM
+static int bitops_lpm32(int, void *, void *);
+static int bitops_lpm128(int, void *, void *);
+#endif
+typedef struct rcu_writer rcu_writer;
+static void rcu_destroy(c3bt_tree_impl *);
+static void rcu_forget(c3bt_tree_impl *);
 
 /*
  * Tree initialization with a common data type.
@@ -128,8 +292,12 @@ bool c3bt_init(c3bt_tree *c3bt, uint kdt, uint koffset, uint kbits)
 {
     c3bt_tree_impl *tree;
 
+#ifdef C3BT_WIDE_CELL
+    CT_ASSERT(sizeof(c3bt_node) == 4);
+#else
     CT_ASSERT(sizeof(c3bt_node) == 3);
-    CT_ASSERT(sizeof(c3bt_cell) == 64);
+#endif
+    CT_ASSERT(sizeof(c3bt_cell) == C3BT_CELL_SIZE);
     CT_ASSERT(sizeof(c3bt_tree) == sizeof(c3bt_tree_impl));
     CT_ASSERT(sizeof(c3bt_cursor) == sizeof(c3bt_cursor_impl));
 
@@ -141,36 +309,80 @@ bool c3bt_init(c3bt_tree *c3bt, uint kdt, uint koffset, uint kbits)
     tree->key_type = kdt;
     switch (kdt) {
         case C3BT_KDT_BITS:
+            crit_select();
             tree->bitops = bitops_bits;
             tree->key_nbits = kbits;
             break;
 #ifdef C3BT_WITH_STRING
         case C3BT_KDT_PSTR:
+            crit_select();
             tree->bitops = bitops_pstr;
             tree->key_nbits = kbits == 0 ? CBIT_MAX + 1 : kbits;
             break;
         case C3BT_KDT_STR:
+            crit_select();
             tree->bitops = bitops_str;
             tree->key_nbits = kbits == 0 ? CBIT_MAX + 1 : kbits;
             break;
+        case C3BT_KDT_BLOB:
+            crit_select();
+            tree->bitops = bitops_blob;
+            tree->key_nbits = kbits == 0 ? CBIT_MAX + 1 : kbits;
+            break;
+        case C3BT_KDT_PHSTR:
+            crit_select();
+            tree->bitops = bitops_phstr;
+            tree->key_nbits = CBIT_MAX + 1;
+            break;
+        case C3BT_KDT_HSTR:
+            crit_select();
+            tree->bitops = bitops_hstr;
+            tree->key_nbits = CBIT_MAX + 1;
+            break;
 #endif
 #ifdef C3BT_WITH_INTS
         case C3BT_KDT_U32:
+            lookup_int_select();
             tree->bitops = bitops_u32;
             tree->key_nbits = 32;
             break;
         case C3BT_KDT_S32:
+            lookup_int_select();
             tree->bitops = bitops_s32;
             tree->key_nbits = 32;
             break;
         case C3BT_KDT_U64:
+            lookup_int_select();
             tree->bitops = bitops_u64;
             tree->key_nbits = 64;
             break;
         case C3BT_KDT_S64:
+            lookup_int_select();
             tree->bitops = bitops_s64;
             tree->key_nbits = 64;
             break;
+#endif
+#ifdef C3BT_WITH_FLOATS
+        case C3BT_KDT_F32:
+            lookup_int_select();
+            tree->bitops = bitops_f32;
+            tree->key_nbits = 32;
+            break;
+        case C3BT_KDT_F64:
+            lookup_int_select();
+            tree->bitops = bitops_f64;
+            tree->key_nbits = 64;
+            break;
+#endif
+#ifdef C3BT_WITH_LPM
+        case C3BT_KDT_LPM32:
+            tree->bitops = bitops_lpm32;
+            tree->key_nbits = 33;
+            break;
+        case C3BT_KDT_LPM128:
+            tree->bitops = bitops_lpm128;
+            tree->key_nbits = 129;
+            break;
 #endif
         default:
             return false;
@@ -197,984 +409,5383 @@ bool c3bt_init_bitops(c3bt_tree *c3bt, int (*bitops)(int, void *, void *))
     return true;
 }
 
+/*
+ * Reference conversions.  A cell reference is resolved against any cell of the
+ * same tree ("near"); uobj references need the tree.
+ */
+#ifdef C3BT_COMPRESSED
+static c3bt_cell *ref_to_cell(c3bt_cell *near, c3bt_ref ref)
+{
+    if (!ref)
+        return NULL;
+    return (c3bt_cell*)(((uintptr_t)near & ~ARENA_MASK)
+        + ((uintptr_t)ref << 6));
+}
+
+static c3bt_ref cell_to_ref(c3bt_cell *cell)
+{
+    return ((uintptr_t)cell & ARENA_MASK) >> 6;
+}
+
+static void *ref_to_uobj(c3bt_tree_impl *tree, c3bt_ref ref)
+{
+    return (void*)(tree->uobj_base + ((uintptr_t)ref << UOBJ_SHIFT));
+}
+
+static c3bt_ref uobj_to_ref(c3bt_tree_impl *tree, void *uobj)
+{
+    return ((uintptr_t)uobj - tree->uobj_base) >> UOBJ_SHIFT;
+}
+
+/*
+ * Check if an uobj can be referenced; the uobj base is set by the first uobj.
+ * Concurrent writers may race to set it: the first one wins, and the others
+ * use its base.
+ */
+static bool uobj_fits(c3bt_tree_impl *tree, void *uobj)
+{
+    uintptr_t base, offset;
+
+    base = __atomic_load_n(&tree->uobj_base, __ATOMIC_ACQUIRE);
+    if (!base) {
+        offset = (uintptr_t)uobj > UOBJ_WINDOW / 2 ?
+            (uintptr_t)uobj - UOBJ_WINDOW / 2 : 1 << UOBJ_SHIFT;
+        if (__atomic_compare_exchange_n(&tree->uobj_base, &base, offset,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            base = offset;
+    }
+    offset = (uintptr_t)uobj - base;
+    return offset != 0 && offset < UOBJ_WINDOW
+        && (offset & ((1 << UOBJ_SHIFT) - 1)) == 0;
+}
+#else
+static c3bt_cell *ref_to_cell(c3bt_cell *near, c3bt_ref ref)
+{
+    return ref;
+}
+
+static c3bt_ref cell_to_ref(c3bt_cell *cell)
+{
+    return cell;
+}
+
+static void *ref_to_uobj(c3bt_tree_impl *tree, c3bt_ref ref)
+{
+    return ref;
+}
+
+static c3bt_ref uobj_to_ref(c3bt_tree_impl *tree, void *uobj)
+{
+    return uobj;
+}
+#endif
+
+/*
+ * Other writers read the parent of a live cell without its lock, and it's
+ * re-pointed when the parent is replaced (see rcu_hold() and rcu_commit()).
+ */
+#ifdef C3BT_WITH_THREADS
+#define PNC_LOAD(cell)      __atomic_load_n(&(cell)->pnc, __ATOMIC_RELAXED)
+#define PNC_STORE(cell, v)  __atomic_store_n(&(cell)->pnc, v, __ATOMIC_RELAXED)
+#else
+#define PNC_LOAD(cell)      ((cell)->pnc)
+#define PNC_STORE(cell, v)  ((cell)->pnc = (v))
+#endif
+
+#if defined(C3BT_BITMAP)
 static int cell_ncount(c3bt_cell *cell)
 {
-    return ((intptr_t)(cell->pnc) & 7) + 1;
+    return __builtin_popcount(cell->nmap);
 }
 
+/* PNC is a plain parent pointer; the node count is kept by the bitmap. */
 static c3bt_cell *cell_parent(c3bt_cell *cell)
 {
-    return (c3bt_cell*)((intptr_t)(cell->pnc) & ~7);
+    return PNC_LOAD(cell);
 }
 
-/* Be careful not to overflow or underflow. */
 static c3bt_cell *cell_make_pnc(c3bt_cell *parent, int count)
 {
-    return (c3bt_cell*)(((intptr_t)parent & ~7) | (count - 1));
+    return parent;
 }
 
 static void cell_set_parent(c3bt_cell *cell, c3bt_cell *parent)
 {
-    int n;
-
-    n = (intptr_t)(cell->pnc) & 7;
-    cell->pnc = (c3bt_cell*)((intptr_t)parent | n);
+    PNC_STORE(cell, parent);
 }
 
 static void cell_inc_ncount(c3bt_cell *cell, int delta)
 {
-    cell->pnc = (c3bt_cell*)((intptr_t)(cell->pnc) + delta);
 }
 
 static void cell_dec_ncount(c3bt_cell *cell, int delta)
 {
-    cell->pnc = (c3bt_cell*)((intptr_t)(cell->pnc) - delta);
+}
+#elif defined(C3BT_COMPRESSED)
+static int cell_ncount(c3bt_cell *cell)
+{
+    return (PNC_LOAD(cell) & PNC_MASK) + 1;
 }
 
-static void cell_free_node(c3bt_cell *cell, int nid)
+static c3bt_cell *cell_parent(c3bt_cell *cell)
 {
-    cell->N[nid].child[0] = INVALID_NODE;
+    return ref_to_cell(cell, PNC_LOAD(cell) >> 3);
 }
 
-static void cell_free_ptr(c3bt_cell *cell, int pid)
+/* Be careful not to overflow or underflow. */
+static c3bt_ref cell_make_pnc(c3bt_cell *parent, int count)
 {
-    cell->P[pid] = NULL;
+    return (parent ? cell_to_ref(parent) << 3 : 0) | (count - 1);
 }
 
-static bool cell_node_is_vacant(c3bt_cell *cell, int nid)
+static void cell_set_parent(c3bt_cell *cell, c3bt_cell *parent)
 {
-    return cell->N[nid].child[0] == INVALID_NODE;
+    PNC_STORE(cell, cell_make_pnc(parent, (PNC_LOAD(cell) & PNC_MASK) + 1));
 }
 
-static uint cell_alloc_node(c3bt_cell *cell)
+static void cell_inc_ncount(c3bt_cell *cell, int delta)
 {
-    int i;
+    cell->pnc += delta;
+}
 
-    for (i = 1; !cell_node_is_vacant(cell, i); i++)
-        /* nothing */;
-    cell->N[i].child[0] = 0;
-    return i;
+static void cell_dec_ncount(c3bt_cell *cell, int delta)
+{
+    cell->pnc -= delta;
+}
+#else
+static int cell_ncount(c3bt_cell *cell)
+{
+    return ((intptr_t)PNC_LOAD(cell) & PNC_MASK) + 1;
 }
 
-static uint cell_alloc_ptr(c3bt_cell *cell)
+static c3bt_cell *cell_parent(c3bt_cell *cell)
 {
-    int i;
+    return (c3bt_cell*)((intptr_t)PNC_LOAD(cell) & ~PNC_MASK);
+}
 
-    for (i = 0; cell->P[i] != NULL; i++)
-        /* nothing */;
-    cell->P[i] = (c3bt_cell*)1;
-    return i;
+/* Be careful not to overflow or underflow. */
+static c3bt_cell *cell_make_pnc(c3bt_cell *parent, int count)
+{
+    return (c3bt_cell*)(((intptr_t)parent & ~PNC_MASK) | (count - 1));
 }
 
-/*
- * Allocate and initialize a new cell.
- *
- * All nodes are marked as vacant, and the rest are zeroed.
- */
-static c3bt_cell *cell_malloc(void)
+static void cell_set_parent(c3bt_cell *cell, c3bt_cell *parent)
 {
-    c3bt_cell *cell;
-    int i;
+    int n;
 
-    cell = malloc(sizeof(c3bt_cell));
-    if (!cell)
-        return NULL;
-    assert(((intptr_t)cell & 7) == 0);
-    memset(cell, 0, sizeof(c3bt_cell));
-    for (i = 0; i < NODES_PER_CELL; i++)
-        cell_free_node(cell, i);
-    return cell;
+    n = (intptr_t)PNC_LOAD(cell) & PNC_MASK;
+    PNC_STORE(cell, (c3bt_cell*)((intptr_t)parent | n));
+}
+
+static void cell_inc_ncount(c3bt_cell *cell, int delta)
+{
+    cell->pnc = (c3bt_cell*)((intptr_t)(cell->pnc) + delta);
 }
 
-static void cell_free(c3bt_cell *cell)
+static void cell_dec_ncount(c3bt_cell *cell, int delta)
 {
-    free(cell);
+    cell->pnc = (c3bt_cell*)((intptr_t)(cell->pnc) - delta);
 }
+#endif
 
 /*
- * Helper function for destruction: find a child cell pointer, delist it and
- * return it to the caller.  This function is stateful and destructive.
+ * Cell references and the root are loaded with acquire semantics, so that a
+ * concurrent reader sees the cells the writer published with them complete
+ * (see c3bt_rcu_enable()).  It's a plain load on x86.
  */
-static c3bt_cell *cell_delist_subcell(c3bt_cell *cell)
+static c3bt_cell *cell_sub(c3bt_cell *cell, int pid)
 {
-    int n, c, tmp;
-
-    if (!cell)
-        return NULL;
-
-    for (n = 0; n < NODES_PER_CELL; n++) {
-        if (cell_node_is_vacant(cell, n))
-            continue;
-        for (c = 0; c < 2; c++)
-            if (CHILD_IS_CELL(cell->N[n].child[c])) {
-                tmp = cell->N[n].child[c] & INDEX_MASK;
-                cell->N[n].child[c] = 0;
-                return cell->P[tmp];
-            }
-    }
-    return NULL;
+#ifdef C3BT_WITH_THREADS
+    return ref_to_cell(cell, __atomic_load_n(&cell->P[pid], __ATOMIC_ACQUIRE));
+#else
+    return ref_to_cell(cell, cell->P[pid]);
+#endif
 }
 
-#ifdef C3BT_STATS
-static void cell_update_popdist(c3bt_cell *cell)
+static c3bt_cell *tree_root(c3bt_tree_impl *tree)
 {
-    int n = cell_ncount(cell) - 1;
-    c3bt_stat_popdist[n]++;
-}
+#ifdef C3BT_WITH_THREADS
+    return __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+#else
+    return tree->root;
 #endif
+}
 
-bool c3bt_destroy(c3bt_tree *c3bt)
+static void tree_set_root(c3bt_tree_impl *tree, c3bt_cell *root)
 {
-    c3bt_cell *cell, *next, *del, *tmp;
-
-    if (c3bt == NULL)
-        return false;
-    /* Iterative Post-order Traversal of N-way Tree With Delayed Node Access.
-     */
-    cell = ((c3bt_tree_impl*)c3bt)->root;
-    del = NULL;
-    while (cell) {
-        next = cell_delist_subcell(cell);
-        if (!next) {
-            cell_free(del);
-            del = cell;
-#ifdef C3BT_STATS
-            cell_update_popdist(cell);
+#ifdef C3BT_WITH_THREADS
+    __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+#else
+    tree->root = root;
 #endif
-            next = cell_delist_subcell(cell_parent(cell));
-            if (!next) {
-                while (cell_parent(cell)) {
-                    next = cell_parent(cell);
-                    cell_free(del);
-                    del = next;
-#ifdef C3BT_STATS
-                    cell_update_popdist(next);
+}
+
+/*
+ * Whether a root cell is a singleton tree's: node 0 has the uobj at P[0] on
+ * one side and a NULL cell on the other.  Lookups test this rather than
+ * n_objects, which a concurrent reader may see out of step with the root.
+ */
+static bool cell_is_singleton(c3bt_cell *root)
+{
+#ifdef C3BT_WITH_THREADS
+    /* P[1] of a live root may be re-pointed by the writer meanwhile. */
+    return NODE_CHILD(root, 0, 1) == (CHILD_CELL_BIT | 1)
+        && !__atomic_load_n(&root->P[1], __ATOMIC_RELAXED);
+#else
+    return NODE_CHILD(root, 0, 1) == (CHILD_CELL_BIT | 1) && !root->P[1];
 #endif
-                    tmp = cell_delist_subcell(cell_parent(next));
-                    if (tmp) {
-                        next = tmp;
-                        break;
-                    } else {
-                        cell = next;
-                        next = NULL;
-                    }
-                }
-            }
-        }
-        cell = next;
-    }
-    cell_free(del);
-    memset(c3bt, 0, sizeof(c3bt_tree_impl));
-    return true;
 }
 
-uint c3bt_nobjects(c3bt_tree *tree)
+static void cell_copy_node(c3bt_cell *dst, int dnid, c3bt_cell *src, int snid)
 {
-    if (!tree)
-        return 0;
-    return (((c3bt_tree_impl*)tree)->n_objects);
+#ifdef C3BT_SOA
+    dst->cbit[dnid] = src->cbit[snid];
+    dst->child[0][dnid] = src->child[0][snid];
+    dst->child[1][dnid] = src->child[1][snid];
+#else
+    dst->N[dnid] = src->N[snid];
+#endif
 }
 
+#ifdef C3BT_SOA
+#define NODE_BITS_MASK      ((1u << NODES_PER_CELL) - 1)
+#define CHILD_BITS_MASK     ((1u << 2 * NODES_PER_CELL) - 1)
+
 /*
- * Tree lookup by key.
+ * Match all children in a cell: return a bitmap where bit n is set if
+ * (child[0][n] & mask) == value, and bit NODES_PER_CELL+n likewise for
+ * child[1][n].  Vacant nodes are not excluded.
  *
- * Lookup from top of the tree trying to find the key, but it won't verify the
- * result.  Cursor is updated if specified.  Special cases:
- *    - Empty tree: return NULL, cur->cell is NULL, nid and cid undefined.
- *    - Singleton tree: always return the uobj and cur is set as (nid=0,
- *      cid=0).
+ * The two child arrays are contiguous, so this is a single compare and
+ * movemask with AVX2 (or SSE2 for 8-node cells).  Loads never cross the end of
+ * the cell.
  */
-static void *tree_lookup(c3bt_tree_impl *tree, void *key, c3bt_cursor_impl *cur)
+static uint cell_child_bits(c3bt_cell *cell, uint8_t mask, uint8_t value)
 {
-    c3bt_cell *cell;
-    c3bt_cursor_impl loc;
-    int nid, cbit_nr, bit;
-    void *robj = NULL;
+#if defined(__AVX2__)
+    __m256i v;
 
-    loc.cell = cell = tree->root;
-    if (tree->n_objects == 1) {
-        loc.nid = 0;
-        loc.cid = 0;
-        robj = cell->P[0];
-        goto done;
-    }
-    while (cell) {
-        loc.cell = cell;
-        nid = 0;
-        while (CHILD_IS_NODE(nid)) {
-            loc.nid = nid;
-            cbit_nr = cell->N[nid].cbit;
-            bit = tree->bitops(cbit_nr, key, NULL);
-            nid = cell->N[nid].child[bit];
-            loc.cid = bit;
-        }
-        if (CHILD_IS_UOBJ(nid)) {
-            robj = cell->P[nid & INDEX_MASK];
-            goto done;
-        }
-        if (CHILD_IS_CELL(nid))
-            cell = cell->P[nid & INDEX_MASK];
-    }
+    v = _mm256_and_si256(_mm256_loadu_si256((__m256i*)cell->child[0]),
+        _mm256_set1_epi8(mask));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(value)))
+        & CHILD_BITS_MASK;
+#elif defined(__SSE2__)
+    __m128i m, x, v;
+    uint bits;
 
-    done:
+    m = _mm_set1_epi8(mask);
+    x = _mm_set1_epi8(value);
+    v = _mm_and_si128(_mm_loadu_si128((__m128i*)cell->child[0]), m);
+    bits = _mm_movemask_epi8(_mm_cmpeq_epi8(v, x));
+#if NODES_PER_CELL > 8
+    v = _mm_and_si128(_mm_loadu_si128((__m128i*)(cell->child[0] + 16)), m);
+    bits |= (uint)_mm_movemask_epi8(_mm_cmpeq_epi8(v, x)) << 16;
+#endif
+    return bits & CHILD_BITS_MASK;
+#else
+    uint n, c, bits = 0;
 
-    if (cur)
-        *cur = loc;
-    return robj;
+    for (c = 0; c < 2; c++)
+        for (n = 0; n < NODES_PER_CELL; n++)
+            if ((cell->child[c][n] & mask) == value)
+                bits |= 1u << (c * NODES_PER_CELL + n);
+    return bits;
+#endif
 }
 
+/* Same as above, but only children of occupied nodes are matched. */
+static uint cell_child_match(c3bt_cell *cell, uint8_t mask, uint8_t value)
+{
+    uint nodes;
+
+#ifdef C3BT_BITMAP
+    nodes = cell->nmap;
+#else
+    nodes = ~cell_child_bits(cell, 0xFF, INVALID_NODE) & NODE_BITS_MASK;
+#endif
+    return cell_child_bits(cell, mask, value)
+        & (nodes | nodes << NODES_PER_CELL);
+}
+
+/* Convert a bit position of the above to nid<<1|cid. */
+static int cell_child_locate(int bit)
+{
+    if (bit < NODES_PER_CELL)
+        return bit << 1;
+    return (bit - NODES_PER_CELL) << 1 | 1;
+}
+#endif
+
+#ifdef C3BT_BITMAP
 /*
- * Find-by-value functions.
+ * Slots are tracked by the node and pointer bitmaps.  Freed pointers are still
+ * cleared, so that a scan by value never hits a stale reference.
  */
+static void cell_free_node(c3bt_cell *cell, int nid)
+{
+    cell->nmap &= ~(1u << nid);
+}
 
-void *c3bt_find_bits(c3bt_tree *c3bt, uint8_t *key)
+static void cell_free_ptr(c3bt_cell *cell, int pid)
 {
-    void *robj;
-    c3bt_tree_impl *tree = (c3bt_tree_impl*)c3bt;
+    cell->P[pid] = NULL_REF;
+    cell->pmap &= ~(1u << pid);
+}
 
-    if (!key || !tree || tree->key_type != C3BT_KDT_BITS)
-        return NULL;
+/* Mark a slot as taken when it's filled directly instead of allocated. */
+static void cell_take_node(c3bt_cell *cell, int nid)
+{
+    cell->nmap |= 1u << nid;
+}
 
-    robj = tree_lookup(tree, key, NULL);
-    if (!robj)
-        return NULL;
-    if (memcmp(key, (char*)robj + tree->key_offset, (tree->key_nbits + 7) / 8)
-        == 0)
-        return robj;
-    return NULL;
+static void cell_take_ptr(c3bt_cell *cell, int pid)
+{
+    cell->pmap |= 1u << pid;
 }
 
-#ifdef C3BT_WITH_INTS
-/* Common for all integers "find-by-value" functions. */
-static void *c3bt_find_integer(c3bt_tree *c3bt, uint64_t key, uint kdt)
+static bool cell_node_is_vacant(c3bt_cell *cell, int nid)
 {
-    union {
-        uint32_t u32;
-        uint64_t u64;
-    } bits;
-    void *robj;
-    c3bt_tree_impl *tree = (c3bt_tree_impl*)c3bt;
+    return !(cell->nmap & (1u << nid));
+}
 
-    if (!tree || tree->key_type != kdt)
-        return NULL;
+static uint cell_alloc_node(c3bt_cell *cell)
+{
+    int i;
 
-    switch (kdt) {
-        case C3BT_KDT_U32:
-        case C3BT_KDT_S32:
-            bits.u32 = (uint32_t)key;
-            break;
-        case C3BT_KDT_U64:
-        case C3BT_KDT_S64:
-            bits.u64 = key;
-            break;
-    }
+    /* Node 0 is never allocated; it's always the cell root. */
+    i = __builtin_ctz(~cell->nmap & ~1u);
+    cell->nmap |= 1u << i;
+    return i;
+}
 
-    robj = tree_lookup(tree, &bits, NULL);
-    if (!robj)
-        return NULL;
-    /* Faster than bitops. */
-    switch (kdt) {
-        case C3BT_KDT_U32:
-        case C3BT_KDT_S32:
-            if (*(uint32_t*)((char*)robj + tree->key_offset) == bits.u32)
-                return robj;
-            break;
-        case C3BT_KDT_U64:
-        case C3BT_KDT_S64:
-            if (*(uint64_t*)((char*)robj + tree->key_offset) == bits.u64)
-                return robj;
-            break;
-    }
-    return NULL;
+static uint cell_alloc_ptr(c3bt_cell *cell)
+{
+    int i;
+
+    i = __builtin_ctz(~cell->pmap);
+    cell->pmap |= 1u << i;
+    return i;
+}
+#else
+static void cell_free_node(c3bt_cell *cell, int nid)
+{
+    NODE_CHILD(cell, nid, 0) = INVALID_NODE;
 }
-#endif
 
-#ifdef C3BT_WITH_INTS
-void *c3bt_find_u32(c3bt_tree *c3bt, uint32_t key)
+static void cell_free_ptr(c3bt_cell *cell, int pid)
 {
-    return c3bt_find_integer(c3bt, (uint64_t)key, C3BT_KDT_U32);
+    cell->P[pid] = NULL_REF;
 }
 
-void *c3bt_find_s32(c3bt_tree *c3bt, int32_t key)
+/* Slots filled directly are taken by their content. */
+static void cell_take_node(c3bt_cell *cell, int nid)
 {
-    return c3bt_find_integer(c3bt, (uint64_t)key, C3BT_KDT_S32);
 }
 
-void *c3bt_find_u64(c3bt_tree *c3bt, uint64_t key)
+static void cell_take_ptr(c3bt_cell *cell, int pid)
 {
-    return c3bt_find_integer(c3bt, key, C3BT_KDT_U64);
 }
 
-void *c3bt_find_s64(c3bt_tree *c3bt, int64_t key)
+static bool cell_node_is_vacant(c3bt_cell *cell, int nid)
 {
-    return c3bt_find_integer(c3bt, (uint64_t)key, C3BT_KDT_S64);
+    return NODE_CHILD(cell, nid, 0) == INVALID_NODE;
 }
-#endif
 
-#ifdef C3BT_WITH_STRING
-void *c3bt_find_str(c3bt_tree *c3bt, char *key)
+static uint cell_alloc_node(c3bt_cell *cell)
 {
-    char *str;
-    void *robj;
-    c3bt_tree_impl *tree;
+    int i;
 
-    if (!key || !c3bt)
-        return NULL;
+#ifdef C3BT_SOA
+    i = __builtin_ctz(cell_child_bits(cell, 0xFF, INVALID_NODE)
+        & NODE_BITS_MASK & ~1u);
+#else
+    for (i = 1; !cell_node_is_vacant(cell, i); i++)
+        /* nothing */;
+#endif
+    NODE_CHILD(cell, i, 0) = 0;
+    return i;
+}
 
-    tree = (c3bt_tree_impl*)c3bt;
-    if (tree->key_type == C3BT_KDT_PSTR) {
-        str = key;
-        robj = tree_lookup(tree, &str, NULL);
-    } else if (tree->key_type == C3BT_KDT_STR)
-        robj = tree_lookup(tree, key, NULL);
-    else
-        return NULL;
-    if (!robj)
-        return NULL;
-    if (tree->key_type == C3BT_KDT_PSTR) {
-        if (strncmp(key, *(char**)((char*)robj + tree->key_offset),
-            tree->key_nbits / 8) == 0)
-            return robj;
-    } else {
-        if (strncmp(key, (char*)robj + tree->key_offset, tree->key_nbits / 8)
-            == 0)
-            return robj;
-    }
-    return NULL;
+static uint cell_alloc_ptr(c3bt_cell *cell)
+{
+    int i;
+
+    for (i = 0; cell->P[i] != NULL_REF; i++)
+        /* nothing */;
+    cell->P[i] = BUSY_REF;
+    return i;
 }
 #endif
 
-void *c3bt_locate(c3bt_tree *c3bt, void *uobj, c3bt_cursor *cur)
+#ifdef C3BT_COMPRESSED
+/*
+ * Reserve the address space of a cell arena.  Pages are committed on first
+ * touch.  Cell 0 is never used so that index 0 can be the NULL reference.
+ */
+static c3bt_cell *arena_create(void)
 {
-    void *robj;
-    c3bt_tree_impl *tree;
+    uintptr_t map, base;
 
-    if (!c3bt || !uobj)
+    map = (uintptr_t)mmap(NULL, 2 * (ARENA_MASK + 1), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == (uintptr_t)MAP_FAILED)
         return NULL;
+    base = (map + ARENA_MASK) & ~ARENA_MASK;
+    if (base > map)
+        munmap((void*)map, base - map);
+    munmap((void*)(base + ARENA_MASK + 1), map + ARENA_MASK + 1 - base);
+#if defined(C3BT_HUGEPAGE) && defined(MADV_HUGEPAGE)
+    madvise((void*)base, ARENA_MASK + 1, MADV_HUGEPAGE);
+#endif
+    return (c3bt_cell*)base;
+}
 
-    tree = (c3bt_tree_impl*)c3bt;
-    robj = tree_lookup(tree, (char*)uobj + tree->key_offset,
-        (c3bt_cursor_impl*)cur);
-    if (!robj)
-        return NULL;
-    if (tree->bitops(-(tree->key_nbits + 1), (char*)uobj + tree->key_offset,
-        (char*)robj + tree->key_offset) == -1)
-        return robj;
-    return NULL;
+static void arena_destroy(c3bt_tree_impl *tree)
+{
+    if (tree->arena)
+        munmap(tree->arena, ARENA_MASK + 1);
 }
 
-/*
- * Go to either extreme end of the tree from a start cursor; used by iteration
- * functions: first(), last(), prev(), next().
- *
- * Tree must have at least 2 uobjs.
- */
-static void *tree_rush_down(c3bt_tree_impl *tree, c3bt_cursor_impl *start,
-    int dir)
+static c3bt_cell *arena_alloc(c3bt_tree_impl *tree)
 {
     c3bt_cell *cell;
-    int nid;
 
-    start->cid = dir;
-    cell = start->cell;
-    nid = start->nid;
-    while (cell) {
-        start->cell = cell;
-        while (CHILD_IS_NODE(nid)) {
-            start->nid = nid;
-            nid = cell->N[nid].child[dir];
-        }
-        if (CHILD_IS_UOBJ(nid))
-            return cell->P[nid & INDEX_MASK];
-        if (CHILD_IS_CELL(nid)) {
-            cell = cell->P[nid & INDEX_MASK];
-            nid = 0;
-        }
+    if (!tree->arena) {
+        tree->arena = arena_create();
+        if (!tree->arena)
+            return NULL;
+        tree->arena_top = 1;
     }
-    return NULL;
+    if (tree->arena_free) {
+        cell = tree->arena + tree->arena_free;
+        tree->arena_free = cell->pnc;
+    } else if (tree->arena_top < ARENA_CELLS)
+        cell = tree->arena + tree->arena_top++;
+    else
+        return NULL;
+    return cell;
 }
-
+#else
+#ifdef C3BT_HUGEPAGE
 /*
- * Go to either extreme of the tree.  Common code for first and last.
+ * Map 2MB-aligned memory backed by huge pages: reserved ones if the system has
+ * any, transparent ones otherwise.
  */
-static void *tree_extreme(c3bt_tree_impl *tree, c3bt_cursor *cur, int dir)
+static void *hugepage_map(size_t size)
 {
-    c3bt_cursor_impl start;
-    void * robj;
+    uintptr_t map, base;
 
-    if (!tree || !tree->root)
+#ifdef MAP_HUGETLB
+    map = (uintptr_t)mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != (uintptr_t)MAP_FAILED)
+        return (void*)map;
+#endif
+    map = (uintptr_t)mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == (uintptr_t)MAP_FAILED)
         return NULL;
-    start.cell = tree->root;
-    start.nid = 0;
-    start.cid = 0;
-    if (tree->n_objects == 1) {
-        /* Singleton tree. */
-        robj = tree->root->P[0];
-        goto done;
-    }
-    robj = tree_rush_down(tree, &start, dir);
+    base = (map + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+    if (base > map)
+        munmap((void*)map, base - map);
+    munmap((void*)(base + size), map + HUGEPAGE_SIZE - base);
+#ifdef MADV_HUGEPAGE
+    madvise((void*)base, size, MADV_HUGEPAGE);
+#endif
+    return (void*)base;
+}
+#endif
 
-    done:
+/* Get a slab of ncells cells and push it onto the tree's slab list. */
+static c3bt_cell *slab_new(c3bt_tree_impl *tree, size_t ncells)
+{
+    slab_head *head;
+    void *mem;
 
-    if (cur)
-        *(c3bt_cursor_impl*)cur = start;
-    return robj;
+#ifdef C3BT_HUGEPAGE
+    if (ncells % SLAB_MAX_CELLS == 0) {
+        mem = hugepage_map(ncells * sizeof(c3bt_cell));
+        if (!mem)
+            return NULL;
+    } else
+#endif
+    if (posix_memalign(&mem, C3BT_CELL_SIZE, ncells * sizeof(c3bt_cell)))
+        return NULL;
+    head = mem;
+    head->next = tree->slab;
+    head->ncells = ncells;
+    tree->slab = mem;
+    tree->slab_top = 1;
+    tree->slab_size = ncells;
+    return mem;
 }
 
-void *c3bt_first(c3bt_tree *c3bt, c3bt_cursor *cur)
+static c3bt_cell *slab_alloc(c3bt_tree_impl *tree)
 {
-    return tree_extreme((c3bt_tree_impl*)c3bt, cur, 0);
+    c3bt_cell *cell;
+    uint32_t size;
+
+    if (tree->slab_free) {
+        cell = tree->slab_free;
+        tree->slab_free = cell->pnc;
+        return cell;
+    }
+    if (tree->slab_top >= tree->slab_size) {
+        size = tree->slab_size ? tree->slab_size * 2 : SLAB_MIN_CELLS;
+        if (size > SLAB_MAX_CELLS)
+            size = SLAB_MAX_CELLS;
+        if (!slab_new(tree, size))
+            return NULL;
+    }
+    return tree->slab + tree->slab_top++;
 }
 
-void *c3bt_last(c3bt_tree *c3bt, c3bt_cursor *cur)
+#ifdef C3BT_WITH_THREADS
+/* Move all slabs of another tree to this one. */
+static void slab_adopt(c3bt_tree_impl *tree, c3bt_tree_impl *from)
 {
-    return tree_extreme((c3bt_tree_impl*)c3bt, cur, 1);
+    slab_head *tail;
+
+    if (!from->slab)
+        return;
+    if (!tree->slab) {
+        tree->slab = from->slab;
+        tree->slab_top = from->slab_top;
+        tree->slab_size = from->slab_size;
+    } else {
+        /* The tree keeps allocating from its current slab. */
+        for (tail = (slab_head*)from->slab; tail->next;
+            tail = (slab_head*)tail->next)
+            /* nothing */;
+        tail->next = ((slab_head*)tree->slab)->next;
+        ((slab_head*)tree->slab)->next = from->slab;
+    }
+    from->slab = NULL;
+}
+
+#endif
+
+/* Release a list of slabs at once, whatever cells are still in use. */
+static void slab_release(c3bt_cell *slab)
+{
+    slab_head *head;
+
+    while (slab) {
+        head = (slab_head*)slab;
+        slab = head->next;
+#ifdef C3BT_HUGEPAGE
+        if (head->ncells % SLAB_MAX_CELLS == 0) {
+            munmap(head, head->ncells * sizeof(c3bt_cell));
+            continue;
+        }
+#endif
+        free(head);
+    }
 }
+#endif
 
 /*
- * Step a cursor backwards or forwards.  Common for next() and prev().
+ * Allocate and initialize a new cell.
+ *
+ * All nodes are marked as vacant, and the rest are zeroed.
  */
-static void *tree_step(c3bt_tree_impl *tree, c3bt_cursor_impl *cur, int dir)
+static void cell_clear(c3bt_cell *cell)
+{
+    int i;
+
+    memset(cell, 0, sizeof(c3bt_cell));
+    for (i = 0; i < NODES_PER_CELL; i++)
+        cell_free_node(cell, i);
+}
+
+static c3bt_cell *cell_malloc(c3bt_tree_impl *tree)
 {
     c3bt_cell *cell;
-    void *uobj;
-    int upper, lower, bit, cur_cbit;
 
-    /* Nowhere to step if tree is null, empty or singleton. */
-    if (!cur || !tree || tree->n_objects < 2)
+#ifdef C3BT_COMPRESSED
+    cell = arena_alloc(tree);
+#else
+    cell = slab_alloc(tree);
+#endif
+    if (!cell)
         return NULL;
+    assert(((intptr_t)cell & PNC_MASK) == 0);
+    cell_clear(cell);
+    return cell;
+}
 
-    /* The easy case: the other sibling is on the desired path. */
-    if (cur->cid != dir)
-        goto down;
-    /* The hard case: find an ancestor from where we can rush down.
-     * Climbing up is cell by cell using the parent pointer; within each
-     * cell it's key-guided descent.
+/* Release all cells of the tree at once. */
+static void cell_free_all(c3bt_tree_impl *tree)
+{
+#ifdef C3BT_COMPRESSED
+    arena_destroy(tree);
+    tree->arena = NULL;
+    tree->arena_top = 0;
+    tree->arena_free = 0;
+#else
+    slab_release(tree->slab);
+    tree->slab = NULL;
+    tree->slab_free = NULL;
+    tree->slab_top = 0;
+    tree->slab_size = 0;
+#endif
+}
+
+static void cell_free(c3bt_tree_impl *tree, c3bt_cell *cell)
+{
+    if (!cell)
+        return;
+#ifdef C3BT_COMPRESSED
+    cell->pnc = tree->arena_free;
+    tree->arena_free = cell_to_ref(cell);
+#else
+    cell->pnc = tree->slab_free;
+    tree->slab_free = cell;
+#endif
+}
+
+#ifdef C3BT_STATS
+/*
+ * Helper function for destruction: find a child cell pointer, delist it and
+ * return it to the caller.  This function is stateful and destructive.
+ */
+static c3bt_cell *cell_delist_subcell(c3bt_cell *cell)
+{
+    int n, c, tmp;
+
+    if (!cell)
+        return NULL;
+
+#ifdef C3BT_SOA
+    n = cell_child_match(cell, CHILD_CELL_BIT, CHILD_CELL_BIT);
+    if (!n)
+        return NULL;
+    n = cell_child_locate(__builtin_ctz(n));
+    c = n & 1;
+    n >>= 1;
+    tmp = NODE_CHILD(cell, n, c) & INDEX_MASK;
+    NODE_CHILD(cell, n, c) = 0;
+    return cell_sub(cell, tmp);
+#else
+    for (n = 0; n < NODES_PER_CELL; n++) {
+        if (cell_node_is_vacant(cell, n))
+            continue;
+        for (c = 0; c < 2; c++)
+            if (CHILD_IS_CELL(NODE_CHILD(cell, n, c))) {
+                tmp = NODE_CHILD(cell, n, c) & INDEX_MASK;
+                NODE_CHILD(cell, n, c) = 0;
+                return cell_sub(cell, tmp);
+            }
+    }
+    return NULL;
+#endif
+}
+
+static void cell_update_popdist(c3bt_cell *cell)
+{
+    int n = cell_ncount(cell) - 1;
+    c3bt_stat_popdist[n]++;
+}
+#endif
+
+bool c3bt_destroy(c3bt_tree *c3bt)
+{
+    c3bt_tree_impl *tree;
+#ifdef C3BT_STATS
+    c3bt_cell *cell, *next, *del, *tmp;
+#endif
+
+    if (c3bt == NULL)
+        return false;
+    tree = (c3bt_tree_impl*)c3bt;
+#ifdef C3BT_STATS
+    /* Cells are released with their slabs below; walking the tree is only
+     * needed for the population distribution.
+     *
+     * Iterative Post-order Traversal of N-way Tree With Delayed Node Access.
      */
-    cur_cbit = cur->cell->N[cur->nid].cbit;
-    cell = cur->cell;
-    uobj = cell->P[cell->N[cur->nid].child[cur->cid] & INDEX_MASK];
+    cell = tree->root;
+    del = NULL;
     while (cell) {
-        lower = 0;
-        upper = INVALID_NODE;
-        while (CHILD_IS_NODE(lower)) {
-            if (cell->N[lower].cbit >= cur_cbit)
-                break;
-            bit = tree->bitops(cell->N[lower].cbit,
-                (char*)uobj + tree->key_offset, NULL);
-            if (bit != dir)
-                upper = lower;
-            lower = cell->N[lower].child[bit];
+        next = cell_delist_subcell(cell);
+        if (!next) {
+            cell_free(tree, del);
+            del = cell;
+#ifdef C3BT_STATS
+            cell_update_popdist(cell);
+#endif
+            next = cell_delist_subcell(cell_parent(cell));
+            if (!next) {
+                while (cell_parent(cell)) {
+                    next = cell_parent(cell);
+                    cell_free(tree, del);
+                    del = next;
+#ifdef C3BT_STATS
+                    cell_update_popdist(next);
+#endif
+                    tmp = cell_delist_subcell(cell_parent(next));
+                    if (tmp) {
+                        next = tmp;
+                        break;
+                    } else {
+                        cell = next;
+                        next = NULL;
+                    }
+                }
+            }
+        }
+        cell = next;
+    }
+    cell_free(tree, del);
+#endif
+    cell_free_all(tree);
+    rcu_destroy(tree);
+    memset(c3bt, 0, sizeof(c3bt_tree_impl));
+    return true;
+}
+
+/*
+ * Sub-cell pointer indices of a cell in key order, for the relayout walk.
+ * Return the number of sub-cells.
+ */
+static int cell_subcells(c3bt_cell *cell, uint8_t *pids)
+{
+    uint8_t stack[NODES_PER_CELL + 1];
+    int sp, n, x;
+
+    n = 0;
+    sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        x = stack[--sp];
+        if (CHILD_IS_NODE(x)) {
+            stack[sp++] = NODE_CHILD(cell, x, 1);
+            stack[sp++] = NODE_CHILD(cell, x, 0);
+        } else if (CHILD_IS_CELL(x))
+            pids[n++] = x & INDEX_MASK;
+    }
+    return n;
+}
+
+/* Explicit stack of cells; the tree can be deeper than the C stack allows. */
+typedef struct cell_stack {
+    c3bt_cell **cells;
+    size_t n;
+    size_t size;
+} cell_stack;
+
+static bool cell_stack_push(cell_stack *stack, c3bt_cell *cell)
+{
+    c3bt_cell **tmp;
+    size_t size;
+
+    if (stack->n == stack->size) {
+        size = stack->size ? stack->size * 2 : 64;
+        tmp = realloc(stack->cells, size * sizeof(c3bt_cell*));
+        if (!tmp)
+            return false;
+        stack->cells = tmp;
+        stack->size = size;
+    }
+    stack->cells[stack->n++] = cell;
+    return true;
+}
+
+bool c3bt_relayout(c3bt_tree *c3bt)
+{
+    c3bt_tree_impl *tree;
+    c3bt_cell *old_root, *cell, *next, *kids[NODES_PER_CELL + 1];
+    uint8_t pids[NODES_PER_CELL + 1];
+    cell_stack stack;
+    size_t ncells;
+    int i, n;
+#ifdef C3BT_COMPRESSED
+    c3bt_cell *old_arena;
+#else
+    c3bt_cell *old_slab;
+#endif
+
+    if (!c3bt)
+        return false;
+    tree = (c3bt_tree_impl*)c3bt;
+    /* Nothing to place without sub-cells. */
+    if (tree->n_objects < 2)
+        return true;
+    memset(&stack, 0, sizeof(stack));
+    old_root = tree->root;
+
+    /* Count the cells, then get the new storage in one piece. */
+    ncells = 0;
+    if (!cell_stack_push(&stack, old_root))
+        goto fail;
+    while (stack.n) {
+        cell = stack.cells[--stack.n];
+        ncells++;
+        n = cell_subcells(cell, pids);
+        while (n--)
+            if (!cell_stack_push(&stack, cell_sub(cell, pids[n])))
+                goto fail;
+    }
+#ifdef C3BT_COMPRESSED
+    if (ncells >= ARENA_CELLS)
+        goto fail;
+    old_arena = tree->arena;
+    tree->arena = arena_create();
+    if (!tree->arena) {
+        tree->arena = old_arena;
+        goto fail;
+    }
+    next = tree->arena + 1;
+    tree->arena_top = ncells + 1;
+    tree->arena_free = 0;
+#else
+    old_slab = tree->slab;
+    tree->slab = NULL;
+    ncells++;
+#ifdef C3BT_HUGEPAGE
+    if (ncells > SLAB_MAX_CELLS)
+        ncells = (ncells + SLAB_MAX_CELLS - 1) / SLAB_MAX_CELLS
+            * SLAB_MAX_CELLS;
+#endif
+    if (ncells > UINT32_MAX || !slab_new(tree, ncells)) {
+        tree->slab = old_slab;
+        goto fail;
+    }
+    next = tree->slab + 1;
+    tree->slab_free = NULL;
+#endif
+
+    /* Copy the cells in depth-first order of sibling groups: all sub-cells of
+     * a cell are placed together in key order, followed by the subtree of the
+     * leftmost one.  Each copy still points to the old sub-cells until it is
+     * popped; old cells are read through the old root's storage.
+     */
+    memcpy(next, old_root, sizeof(c3bt_cell));
+    tree->root = next++;
+    stack.cells[stack.n++] = tree->root;
+    while (stack.n) {
+        cell = stack.cells[--stack.n];
+        n = cell_subcells(cell, pids);
+        for (i = 0; i < n; i++) {
+            kids[i] = next++;
+            memcpy(kids[i], ref_to_cell(old_root, cell->P[pids[i]]),
+                sizeof(c3bt_cell));
+            cell_set_parent(kids[i], cell);
+            cell->P[pids[i]] = cell_to_ref(kids[i]);
+        }
+        /* Same walk as the counting pass, so the stack is big enough. */
+        while (n--)
+            stack.cells[stack.n++] = kids[n];
+    }
+#ifndef C3BT_COMPRESSED
+    tree->slab_top = next - tree->slab;
+#endif
+
+#ifdef C3BT_COMPRESSED
+    munmap(old_arena, ARENA_MASK + 1);
+#else
+    slab_release(old_slab);
+#endif
+    rcu_forget(tree);
+    free(stack.cells);
+    return true;
+
+fail:
+    free(stack.cells);
+    return false;
+}
+
+size_t c3bt_nobjects(c3bt_tree *tree)
+{
+    if (!tree)
+        return 0;
+    return (((c3bt_tree_impl*)tree)->n_objects);
+}
+
+#ifdef C3BT_LOOKUP_STATS
+/*
+ * Mark the cache line (relative to cell start) an access falls in.  Cells are
+ * at most 2 lines long but may straddle 3 if not line-aligned.
+ */
+static void stat_touch(c3bt_cell *cell, void *p, uint *lines)
+{
+    *lines |= 1u << (((uintptr_t)p >> 6) - ((uintptr_t)cell >> 6));
+}
+#endif
+
+/*
+ * Key bits of a string key for the length of one operation.  bitops_str() has
+ * to look for the NUL at every bit; here the run of leading non-NUL bytes found
+ * so far is kept in known, so each byte is scanned at most once, and only as
+ * far as the bits asked for.  Likewise the tail hash of HSTR keys is taken once,
+ * when first needed.  key_str() sets up a STR, PSTR, HSTR or PHSTR key, or
+ * returns false for other key types; key_sk() returns the str_key, or NULL.
+ */
+typedef struct str_key {
+    uint8_t *str;
+    uint64_t hash; /* HSTR: hash of the tail, once taken. */
+    uint known; /* leading bytes known to be non-NUL. */
+    int tail; /* HSTR: 1 if the hash is taken, 0 if not yet; STR: -1. */
+} str_key;
+
+#ifdef C3BT_WITH_STRING
+static uint64_t hstr_hash(const uint8_t *str);
+static int str_crit(str_key *sk1, str_key *sk2, int nbits);
+
+static inline _inline void str_key_init(str_key *sk, uint8_t *str, bool hstr)
+{
+    sk->str = str;
+    sk->hash = 0;
+    sk->known = 0;
+    sk->tail = hstr ? 0 : -1;
+}
+
+static inline _inline bool key_str(c3bt_tree_impl *tree, void *key,
+    str_key *sk)
+{
+    switch (tree->key_type) {
+        case C3BT_KDT_STR:
+            str_key_init(sk, key, false);
+            break;
+        case C3BT_KDT_HSTR:
+            str_key_init(sk, key, true);
+            break;
+        case C3BT_KDT_PSTR:
+            str_key_init(sk, *(uint8_t**)key, false);
+            break;
+        case C3BT_KDT_PHSTR:
+            str_key_init(sk, *(uint8_t**)key, true);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+static inline _inline uint64_t str_hash(str_key *sk)
+{
+    if (!sk->tail) {
+        sk->hash = hstr_hash(sk->str);
+        sk->tail = 1;
+    }
+    return sk->hash;
+}
+
+static inline _inline int str_bit(str_key *sk, int req)
+{
+    uint i = (uint)req / 8;
+
+    if (sk->tail >= 0 && i >= HSTR_HEAD)
+        return str_hash(sk) >> (63 - (req - HSTR_HEAD * 8)) & 1;
+    if (i >= sk->known) {
+        sk->known += strnlen((char*)sk->str + sk->known, i + 1 - sk->known);
+        if (i >= sk->known)
+            return 0;
+    }
+    return sk->str[i] & (0x80u >> (req % 8)) ? 1 : 0;
+}
+#endif
+
+static inline _inline str_key *key_sk(c3bt_tree_impl *tree, void *key,
+    str_key *sk)
+{
+#ifdef C3BT_WITH_STRING
+    if (key_str(tree, key, sk))
+        return sk;
+#endif
+    return NULL;
+}
+
+/*
+ * Bit req of a key, by its str_key if it has one (see key_sk()), else by
+ * bitops.
+ */
+static inline _inline int key_bit(c3bt_tree_impl *tree, str_key *sk, void *key,
+    int req)
+{
+#ifdef C3BT_WITH_STRING
+    if (sk)
+        return str_bit(sk, req);
+#endif
+    return tree->bitops(req, key, NULL);
+}
+
+/*
+ * The crit-bit of two keys, or -1 if they are the same.  With a str_key for
+ * either, the string keys are compared by str_keys, so that a hash already
+ * taken isn't taken again.
+ */
+static int key_crit(c3bt_tree_impl *tree, void *key1, str_key *sk1,
+    void *key2, str_key *sk2)
+{
+#ifdef C3BT_WITH_STRING
+    str_key own1, own2;
+
+    if (sk1 || sk2) {
+        if (!sk1)
+            key_str(tree, key1, sk1 = &own1);
+        if (!sk2)
+            key_str(tree, key2, sk2 = &own2);
+        return str_crit(sk1, sk2, tree->key_nbits);
+    }
+#endif
+    return tree->bitops(-(tree->key_nbits + 1), key1, key2);
+}
+
+/*
+ * Tree lookup by key.
+ *
+ * Lookup from top of the tree trying to find the key, but it won't verify the
+ * result.  Cursor is updated if specified.  The caller loads the root, so that
+ * an adding writer walks the same tree again for the insertion point, and may
+ * pass the str_key of the key (see key_sk()) to go on using it.  Special cases:
+ *    - Empty tree: return NULL, cur->cell is NULL, nid and cid undefined.
+ *    - Singleton tree: always return the uobj and cur is set as (nid=0,
+ *      cid=0).
+ */
+static void *tree_lookup(c3bt_tree_impl *tree, c3bt_cell *root, void *key,
+    str_key *sk, c3bt_cursor_impl *cur)
+{
+    c3bt_cell *cell;
+    c3bt_cursor_impl loc;
+    str_key own;
+    int nid, cbit_nr, bit;
+    void *robj = NULL;
+#ifdef C3BT_LOOKUP_STATS
+    uint lines;
+
+    c3bt_stat_lookups++;
+#endif
+
+    loc.cell = cell = root;
+    if (cell && cell_is_singleton(cell)) {
+        loc.nid = 0;
+        loc.cid = 0;
+        robj = ref_to_uobj(tree, cell->P[0]);
+        goto done;
+    }
+    if (!sk)
+        sk = key_sk(tree, key, &own);
+    while (cell) {
+        loc.cell = cell;
+        nid = 0;
+#ifdef C3BT_LOOKUP_STATS
+        lines = 0;
+#endif
+        while (CHILD_IS_NODE(nid)) {
+            loc.nid = nid;
+            cbit_nr = NODE_CBIT(cell, nid);
+            bit = key_bit(tree, sk, key, cbit_nr);
+#ifdef C3BT_LOOKUP_STATS
+            stat_touch(cell, &NODE_CBIT(cell, nid), &lines);
+#endif
+            nid = NODE_CHILD(cell, nid, bit);
+            loc.cid = bit;
+        }
+#ifdef C3BT_LOOKUP_STATS
+        stat_touch(cell, &cell->P[nid & INDEX_MASK], &lines);
+        c3bt_stat_lookup_cells++;
+        c3bt_stat_lookup_lines += __builtin_popcount(lines);
+#endif
+        if (CHILD_IS_UOBJ(nid)) {
+            robj = ref_to_uobj(tree, cell->P[nid & INDEX_MASK]);
+            goto done;
+        }
+        if (CHILD_IS_CELL(nid))
+            cell = cell_sub(cell, nid & INDEX_MASK);
+    }
+
+    done:
+
+    if (cur)
+        *cur = loc;
+    return robj;
+}
+
+/*
+ * Find-by-value functions.
+ */
+
+void *c3bt_find_bits(c3bt_tree *c3bt, uint8_t *key)
+{
+    void *robj;
+    c3bt_tree_impl *tree = (c3bt_tree_impl*)c3bt;
+
+    if (!key || !tree || tree->key_type != C3BT_KDT_BITS)
+        return NULL;
+
+    robj = tree_lookup(tree, tree_root(tree), key, NULL, NULL);
+    if (!robj)
+        return NULL;
+    if (memcmp(key, (char*)robj + tree->key_offset, (tree->key_nbits + 7) / 8)
+        == 0)
+        return robj;
+    return NULL;
+}
+
+#ifdef C3BT_WITH_INTS
+/*
+ * Lookup engine for integer keys.
+ *
+ * The key is normalized to a left-aligned, unsigned 64-bit value, so the bit
+ * at cbit is just (key << cbit) >> 63 and bitops is never called.  Entering a
+ * cell, the direction bits of all its nodes are extracted at once into a
+ * bitmap; they don't depend on each other, so the descent within the cell only
+ * waits on the child loads.  Vacant nodes produce garbage bits that are never
+ * used.
+ */
+static inline _inline void *lookup_int_body(c3bt_tree_impl *tree, uint64_t key)
+{
+    c3bt_cell *cell;
+    uint dirs;
+    int n, nid;
+#ifdef C3BT_LOOKUP_STATS
+    uint lines;
+
+    c3bt_stat_lookups++;
+#endif
+
+    cell = tree_root(tree);
+    if (cell && cell_is_singleton(cell))
+        return ref_to_uobj(tree, cell->P[0]);
+    while (cell) {
+        dirs = 0;
+        for (n = 0; n < NODES_PER_CELL; n++)
+            dirs |= (uint)((key << (NODE_CBIT(cell, n) & 63)) >> 63) << n;
+        nid = 0;
+#ifdef C3BT_LOOKUP_STATS
+        lines = 0;
+#endif
+        while (CHILD_IS_NODE(nid)) {
+#ifdef C3BT_LOOKUP_STATS
+            stat_touch(cell, &NODE_CBIT(cell, nid), &lines);
+#endif
+            nid = NODE_CHILD(cell, nid, dirs >> nid & 1);
+        }
+#ifdef C3BT_LOOKUP_STATS
+        stat_touch(cell, &cell->P[nid & INDEX_MASK], &lines);
+        c3bt_stat_lookup_cells++;
+        c3bt_stat_lookup_lines += __builtin_popcount(lines);
+#endif
+        if (CHILD_IS_UOBJ(nid))
+            return ref_to_uobj(tree, cell->P[nid & INDEX_MASK]);
+        cell = cell_sub(cell, nid & INDEX_MASK);
+    }
+    return NULL;
+}
+
+static void *lookup_int_generic(c3bt_tree_impl *tree, uint64_t key)
+{
+    return lookup_int_body(tree, key);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Same engine; BMI2 turns the variable shifts into single-uop SHLX/SHRX. */
+__attribute__((target("bmi2")))
+static void *lookup_int_bmi2(c3bt_tree_impl *tree, uint64_t key)
+{
+    return lookup_int_body(tree, key);
+}
+#endif
+
+static void *(*lookup_int)(c3bt_tree_impl *, uint64_t) = lookup_int_generic;
+
+/* Pick the integer lookup engine by CPU features; called by c3bt_init(). */
+static void lookup_int_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2"))
+        lookup_int = lookup_int_bmi2;
+#endif
+}
+
+/* Common for all integers "find-by-value" functions. */
+#ifdef C3BT_WITH_FLOATS
+/*
+ * Map IEEE 754 bits to unsigned integers of the same order: flip all bits of
+ * negatives, only the sign bit of positives.  -0 is folded to +0 and NaNs to
+ * one quiet NaN, which lands after +inf.
+ */
+static inline _inline uint32_t f32_order(uint32_t bits)
+{
+    if ((bits & 0x7FFFFFFFu) == 0)
+        bits = 0;
+    else if ((bits & 0x7FFFFFFFu) > 0x7F800000u)
+        bits = 0x7FC00000u;
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+static inline _inline uint64_t f64_order(uint64_t bits)
+{
+    if ((bits & 0x7FFFFFFFFFFFFFFFull) == 0)
+        bits = 0;
+    else if ((bits & 0x7FFFFFFFFFFFFFFFull) > 0x7FF0000000000000ull)
+        bits = 0x7FF8000000000000ull;
+    return bits & 0x8000000000000000ull ? ~bits
+        : bits | 0x8000000000000000ull;
+}
+#endif
+
+/* Integer and float keys come as their bits in key. */
+static void *c3bt_find_integer(c3bt_tree *c3bt, uint64_t key, uint kdt)
+{
+    union {
+        uint32_t u32;
+        uint64_t u64;
+    } bits;
+    void *robj;
+    c3bt_tree_impl *tree = (c3bt_tree_impl*)c3bt;
+
+    if (!tree || tree->key_type != kdt)
+        return NULL;
+
+    /* Normalize to the left-aligned unsigned form lookup_int() expects. */
+    switch (kdt) {
+        case C3BT_KDT_U32:
+            bits.u32 = (uint32_t)key;
+            robj = lookup_int(tree, (uint64_t)bits.u32 << 32);
+            break;
+        case C3BT_KDT_S32:
+            bits.u32 = (uint32_t)key;
+            robj = lookup_int(tree, (uint64_t)(bits.u32 ^ 0x80000000u) << 32);
+            break;
+        case C3BT_KDT_U64:
+            bits.u64 = key;
+            robj = lookup_int(tree, bits.u64);
+            break;
+        case C3BT_KDT_S64:
+            bits.u64 = key;
+            robj = lookup_int(tree, bits.u64 ^ 0x8000000000000000ull);
+            break;
+#ifdef C3BT_WITH_FLOATS
+        case C3BT_KDT_F32:
+            bits.u32 = f32_order((uint32_t)key);
+            robj = lookup_int(tree, (uint64_t)bits.u32 << 32);
+            break;
+        case C3BT_KDT_F64:
+            bits.u64 = f64_order(key);
+            robj = lookup_int(tree, bits.u64);
+            break;
+#endif
+        default:
+            return NULL;
+    }
+    if (!robj)
+        return NULL;
+    /* Faster than bitops. */
+    switch (kdt) {
+        case C3BT_KDT_U32:
+        case C3BT_KDT_S32:
+            if (*(uint32_t*)((char*)robj + tree->key_offset) == bits.u32)
+                return robj;
+            break;
+        case C3BT_KDT_U64:
+        case C3BT_KDT_S64:
+            if (*(uint64_t*)((char*)robj + tree->key_offset) == bits.u64)
+                return robj;
+            break;
+#ifdef C3BT_WITH_FLOATS
+        case C3BT_KDT_F32:
+            if (f32_order(*(uint32_t*)((char*)robj + tree->key_offset))
+                == bits.u32)
+                return robj;
+            break;
+        case C3BT_KDT_F64:
+            if (f64_order(*(uint64_t*)((char*)robj + tree->key_offset))
+                == bits.u64)
+                return robj;
+            break;
+#endif
+    }
+    return NULL;
+}
+#endif
+
+#ifdef C3BT_WITH_INTS
+void *c3bt_find_u32(c3bt_tree *c3bt, uint32_t key)
+{
+    return c3bt_find_integer(c3bt, (uint64_t)key, C3BT_KDT_U32);
+}
+
+void *c3bt_find_s32(c3bt_tree *c3bt, int32_t key)
+{
+    return c3bt_find_integer(c3bt, (uint64_t)key, C3BT_KDT_S32);
+}
+
+void *c3bt_find_u64(c3bt_tree *c3bt, uint64_t key)
+{
+    return c3bt_find_integer(c3bt, key, C3BT_KDT_U64);
+}
+
+void *c3bt_find_s64(c3bt_tree *c3bt, int64_t key)
+{
+    return c3bt_find_integer(c3bt, (uint64_t)key, C3BT_KDT_S64);
+}
+#endif
+
+#ifdef C3BT_WITH_FLOATS
+void *c3bt_find_f32(c3bt_tree *c3bt, float key)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &key, sizeof(bits));
+    return c3bt_find_integer(c3bt, (uint64_t)bits, C3BT_KDT_F32);
+}
+
+void *c3bt_find_f64(c3bt_tree *c3bt, double key)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &key, sizeof(bits));
+    return c3bt_find_integer(c3bt, bits, C3BT_KDT_F64);
+}
+#endif
+
+#ifdef C3BT_WITH_STRING
+void *c3bt_find_str(c3bt_tree *c3bt, char *key)
+{
+    char *str, *rkey;
+    void *robj;
+    c3bt_tree_impl *tree;
+    bool byptr;
+
+    if (!key || !c3bt)
+        return NULL;
+
+    tree = (c3bt_tree_impl*)c3bt;
+    switch (tree->key_type) {
+        case C3BT_KDT_PSTR:
+        case C3BT_KDT_PHSTR:
+            byptr = true;
+            break;
+        case C3BT_KDT_STR:
+        case C3BT_KDT_HSTR:
+            byptr = false;
+            break;
+        default:
+            return NULL;
+    }
+    str = key;
+    robj = tree_lookup(tree, tree_root(tree), byptr ? (void*)&str : key,
+        NULL, NULL);
+    if (!robj)
+        return NULL;
+    rkey = (char*)robj + tree->key_offset;
+    if (byptr)
+        rkey = *(char**)rkey;
+    /* HSTR keys are equal on a hash collision, so compare the whole string. */
+    if (tree->key_type == C3BT_KDT_HSTR || tree->key_type == C3BT_KDT_PHSTR)
+        return strcmp(key, rkey) == 0 ? robj : NULL;
+    return strncmp(key, rkey, tree->key_nbits / 8) == 0 ? robj : NULL;
+}
+
+void *c3bt_find_blob(c3bt_tree *c3bt, const void *ptr, size_t len)
+{
+    c3bt_blob key;
+    void *robj;
+    c3bt_tree_impl *tree;
+
+    if (!c3bt || (!ptr && len))
+        return NULL;
+    tree = (c3bt_tree_impl*)c3bt;
+    if (tree->key_type != C3BT_KDT_BLOB)
+        return NULL;
+    key.data = ptr;
+    key.len = len;
+    robj = tree_lookup(tree, tree_root(tree), &key, NULL, NULL);
+    if (robj && bitops_blob(-(tree->key_nbits + 1), &key,
+        (char*)robj + tree->key_offset) == -1)
+        return robj;
+    return NULL;
+}
+#endif
+
+/*
+ * Batched lookup.  Up to BATCH_WIDTH lookups are in flight, visited round-robin
+ * (asynchronous memory access chaining): each visit walks one cell, prefetches
+ * whatever comes next -- the sub-cell, or the key in the candidate uobj -- and
+ * moves on, so the next visit to the same lookup finds its data in cache while
+ * the misses of all lookups overlap.
+ */
+#define BATCH_WIDTH         16
+
+typedef struct batch_slot {
+    uint64_t ikey; /* normalized integer key, see lookup_int(). */
+    c3bt_cell *cell; /* the cell to walk next; NULL when robj is to check. */
+    void *robj; /* the candidate uobj. */
+    size_t i; /* index of the key. */
+    str_key sk; /* of a string key, kept across the cells. */
+} batch_slot;
+
+static void cell_prefetch(c3bt_cell *cell)
+{
+    __builtin_prefetch(cell);
+#if C3BT_CELL_SIZE > 64
+    __builtin_prefetch((char*)cell + 64);
+#endif
+}
+
+/* Walk a cell with bitops, or the str_key; return the exit child. */
+static int cell_walk(c3bt_tree_impl *tree, c3bt_cell *cell, void *key,
+    str_key *sk)
+{
+    int nid = 0;
+
+    while (CHILD_IS_NODE(nid))
+        nid = NODE_CHILD(cell, nid, key_bit(tree, sk, key,
+            NODE_CBIT(cell, nid)));
+    return nid;
+}
+
+#ifdef C3BT_WITH_INTS
+/* Same for a normalized integer key, without bitops. */
+static int cell_walk_int(c3bt_cell *cell, uint64_t key)
+{
+    int nid = 0;
+
+    while (CHILD_IS_NODE(nid))
+        nid = NODE_CHILD(cell, nid, (key << NODE_CBIT(cell, nid)) >> 63);
+    return nid;
+}
+
+static uint64_t int_key_normalize(uint kdt, void *key)
+{
+    switch (kdt) {
+        case C3BT_KDT_U32:
+            return (uint64_t)*(uint32_t*)key << 32;
+        case C3BT_KDT_S32:
+            return (uint64_t)(*(uint32_t*)key ^ 0x80000000u) << 32;
+        case C3BT_KDT_S64:
+            return *(uint64_t*)key ^ 0x8000000000000000ull;
+#ifdef C3BT_WITH_FLOATS
+        case C3BT_KDT_F32:
+            return (uint64_t)f32_order(*(uint32_t*)key) << 32;
+        case C3BT_KDT_F64:
+            return f64_order(*(uint64_t*)key);
+#endif
+        default:
+            return *(uint64_t*)key;
+    }
+}
+
+/* Keys that int_key_normalize() handles. */
+static bool key_is_int(c3bt_tree_impl *tree)
+{
+#ifdef C3BT_WITH_FLOATS
+    if (tree->key_type == C3BT_KDT_F32 || tree->key_type == C3BT_KDT_F64)
+        return true;
+#endif
+    return tree->key_type >= C3BT_KDT_U32 && tree->key_type <= C3BT_KDT_S64;
+}
+#endif
+
+/* Check if robj has the key. */
+static bool key_matches(c3bt_tree_impl *tree, void *key, void *robj)
+{
+    robj = (char*)robj + tree->key_offset;
+    switch (tree->key_type) {
+#ifdef C3BT_WITH_INTS
+        case C3BT_KDT_U32:
+        case C3BT_KDT_S32:
+            return *(uint32_t*)key == *(uint32_t*)robj;
+        case C3BT_KDT_U64:
+        case C3BT_KDT_S64:
+            return *(uint64_t*)key == *(uint64_t*)robj;
+#endif
+#ifdef C3BT_WITH_FLOATS
+        case C3BT_KDT_F32:
+            return f32_order(*(uint32_t*)key) == f32_order(*(uint32_t*)robj);
+        case C3BT_KDT_F64:
+            return f64_order(*(uint64_t*)key) == f64_order(*(uint64_t*)robj);
+#endif
+#ifdef C3BT_WITH_STRING
+        case C3BT_KDT_STR:
+            return strncmp(key, robj, tree->key_nbits / 8) == 0;
+        case C3BT_KDT_PSTR:
+            return strncmp(*(char**)key, *(char**)robj,
+                tree->key_nbits / 8) == 0;
+        case C3BT_KDT_HSTR:
+            return strcmp(key, robj) == 0;
+        case C3BT_KDT_PHSTR:
+            return strcmp(*(char**)key, *(char**)robj) == 0;
+#endif
+        case C3BT_KDT_BITS:
+            return memcmp(key, robj, (tree->key_nbits + 7) / 8) == 0;
+        default:
+            return tree->bitops(-(tree->key_nbits + 1), key, robj) == -1;
+    }
+}
+
+size_t c3bt_find_batch(c3bt_tree *c3bt, void **keys, size_t n, void **results)
+{
+    c3bt_tree_impl *tree;
+    batch_slot slots[BATCH_WIDTH], *slot;
+    c3bt_cell *root;
+    size_t next, found;
+    int s, active, x;
+    bool str = false;
+#ifdef C3BT_WITH_INTS
+    bool ints;
+#endif
+
+    if (!c3bt || !keys || !results)
+        return 0;
+    tree = (c3bt_tree_impl*)c3bt;
+    root = tree_root(tree);
+    if (!root || cell_is_singleton(root)) {
+        for (next = found = 0; next < n; next++) {
+            results[next] = root ? ref_to_uobj(tree, root->P[0]) : NULL;
+            if (results[next] && !key_matches(tree, keys[next], results[next]))
+                results[next] = NULL;
+            found += results[next] != NULL;
+        }
+        return found;
+    }
+#ifdef C3BT_WITH_INTS
+    ints = key_is_int(tree);
+#endif
+
+    next = found = 0;
+    for (active = 0; active < BATCH_WIDTH && next < n; active++) {
+        slots[active].cell = root;
+        slots[active].i = next++;
+        str = key_sk(tree, keys[slots[active].i], &slots[active].sk) != NULL;
+#ifdef C3BT_WITH_INTS
+        if (ints)
+            slots[active].ikey = int_key_normalize(tree->key_type,
+                keys[slots[active].i]);
+#endif
+    }
+    while (active) {
+        for (s = 0; s < active; s++) {
+            slot = slots + s;
+            if (!slot->cell) {
+                /* The candidate's key is in cache by now. */
+                if (key_matches(tree, keys[slot->i], slot->robj)) {
+                    results[slot->i] = slot->robj;
+                    found++;
+                } else
+                    results[slot->i] = NULL;
+                if (next == n) {
+                    /* Retire the slot; the last one takes its place. */
+                    *slot = slots[--active];
+                    s--;
+                    continue;
+                }
+                slot->cell = root;
+                slot->i = next++;
+                key_sk(tree, keys[slot->i], &slot->sk);
+#ifdef C3BT_WITH_INTS
+                if (ints)
+                    slot->ikey = int_key_normalize(tree->key_type,
+                        keys[slot->i]);
+#endif
+            }
+#ifdef C3BT_WITH_INTS
+            if (ints)
+                x = cell_walk_int(slot->cell, slot->ikey);
+            else
+#endif
+                x = cell_walk(tree, slot->cell, keys[slot->i],
+                    str ? &slot->sk : NULL);
+            if (CHILD_IS_UOBJ(x)) {
+                slot->robj = ref_to_uobj(tree, slot->cell->P[x & INDEX_MASK]);
+                slot->cell = NULL;
+                __builtin_prefetch((char*)slot->robj + tree->key_offset);
+            } else {
+                slot->cell = cell_sub(slot->cell, x & INDEX_MASK);
+                cell_prefetch(slot->cell);
+            }
+        }
+    }
+    return found;
+}
+
+/*
+ * Merge-join lookup.  Two keys differing first at bit d take the same way at
+ * every node with cbit < d, so the path of the previous key is kept and each
+ * key resumes from its first node with cbit >= d rather than from the root.
+ * Any key order is correct; sorted keys share the longest prefixes.
+ */
+typedef struct sorted_step {
+    c3bt_cell *cell;
+    int nid;
+    int cbit;
+} sorted_step;
+
+/*
+ * The path of the previous key.  It starts on the stack and grows as deep as
+ * the tree is: cbits strictly ascend along it, so it's short but for the
+ * deepest trees of long keys.
+ */
+typedef struct sorted_path {
+    sorted_step *steps;
+    size_t depth;
+    size_t size;
+    sorted_step local[64];
+} sorted_path;
+
+static bool sorted_grow(sorted_path *path)
+{
+    sorted_step *steps;
+
+    steps = malloc(path->size * 2 * sizeof(sorted_step));
+    if (!steps)
+        return false;
+    memcpy(steps, path->steps, path->depth * sizeof(sorted_step));
+    if (path->steps != path->local)
+        free(path->steps);
+    path->steps = steps;
+    path->size *= 2;
+    return true;
+}
+
+/*
+ * Walk down from nid in cell, appending the nodes to path; return the leaf, or
+ * NULL if the path can't grow.
+ */
+static void *sorted_walk(c3bt_tree_impl *tree, sorted_path *path,
+    c3bt_cell *cell, int nid, void *key, str_key *sk, bool ints, uint64_t ikey)
+{
+    sorted_step *step;
+
+    while (!CHILD_IS_UOBJ(nid)) {
+        if (CHILD_IS_CELL(nid)) {
+            cell = cell_sub(cell, nid & INDEX_MASK);
+            nid = 0;
+            continue;
+        }
+        if (path->depth == path->size && !sorted_grow(path))
+            return NULL;
+        step = path->steps + path->depth++;
+        step->cell = cell;
+        step->nid = nid;
+        step->cbit = NODE_CBIT(cell, nid);
+        if (ints)
+            nid = NODE_CHILD(cell, nid, (ikey << NODE_CBIT(cell, nid)) >> 63);
+        else
+            nid = NODE_CHILD(cell, nid,
+                key_bit(tree, sk, key, NODE_CBIT(cell, nid)));
+    }
+    return ref_to_uobj(tree, cell->P[nid & INDEX_MASK]);
+}
+
+size_t c3bt_find_sorted(c3bt_tree *c3bt, void **keys, size_t n,
+    void **results)
+{
+    c3bt_tree_impl *tree;
+    sorted_path path;
+    sorted_step *step;
+    c3bt_cell *root;
+    str_key skeys[2], *sk, *psk = NULL;
+    size_t i, found, top;
+    void *robj = NULL;
+    uint64_t ikey = 0, pkey;
+    bool ints = false;
+    int d;
+
+    if (!c3bt || !keys || !results)
+        return 0;
+    tree = (c3bt_tree_impl*)c3bt;
+    root = tree_root(tree);
+    if (!root || cell_is_singleton(root))
+        return c3bt_find_batch(c3bt, keys, n, results);
+#ifdef C3BT_WITH_INTS
+    ints = key_is_int(tree);
+#endif
+
+    path.steps = path.local;
+    path.depth = 0;
+    path.size = sizeof(path.local) / sizeof(sorted_step);
+    found = 0;
+    for (i = 0; i < n; i++) {
+        pkey = ikey;
+#ifdef C3BT_WITH_INTS
+        if (ints)
+            ikey = int_key_normalize(tree->key_type, keys[i]);
+#endif
+        /* The previous key's str_key is kept for the crit-bit. */
+        sk = key_sk(tree, keys[i], skeys + i % 2);
+        if (i == 0)
+            robj = sorted_walk(tree, &path, root, 0, keys[i], sk, ints, ikey);
+        else {
+            if (ints)
+                d = ikey == pkey ? -1 : __builtin_clzll(ikey ^ pkey);
+            else
+                d = key_crit(tree, keys[i - 1], psk, keys[i], sk);
+            top = path.depth;
+            while (d >= 0 && path.depth
+                && path.steps[path.depth - 1].cbit >= d)
+                path.depth--;
+            /* If no node is dropped, the key ends at the same leaf. */
+            if (path.depth < top) {
+                step = path.steps + path.depth;
+                robj = sorted_walk(tree, &path, step->cell, step->nid, keys[i],
+                    sk, ints, ikey);
+            }
+        }
+        if (!robj) {
+            /* Out of memory for the path: look up the rest in batches. */
+            found += c3bt_find_batch(c3bt, keys + i, n - i, results + i);
+            break;
+        }
+        results[i] = key_matches(tree, keys[i], robj) ? robj : NULL;
+        found += results[i] != NULL;
+        psk = sk;
+    }
+
+    if (path.steps != path.local)
+        free(path.steps);
+    return found;
+}
+
+void *c3bt_locate(c3bt_tree *c3bt, void *uobj, c3bt_cursor *cur)
+{
+    void *robj, *key;
+    c3bt_tree_impl *tree;
+    str_key skey, *sk;
+
+    if (!c3bt || !uobj)
+        return NULL;
+
+    tree = (c3bt_tree_impl*)c3bt;
+    key = (char*)uobj + tree->key_offset;
+    sk = key_sk(tree, key, &skey);
+    robj = tree_lookup(tree, tree_root(tree), key, sk, (c3bt_cursor_impl*)cur);
+    if (!robj)
+        return NULL;
+    if (key_crit(tree, key, sk, (char*)robj + tree->key_offset, NULL) == -1)
+        return robj;
+    return NULL;
+}
+
+/*
+ * Go to either extreme end of the tree from a start cursor; used by iteration
+ * functions: first(), last(), prev(), next().
+ *
+ * Tree must have at least 2 uobjs.
+ */
+static void *tree_rush_down(c3bt_tree_impl *tree, c3bt_cursor_impl *start,
+    int dir)
+{
+    c3bt_cell *cell;
+    int nid;
+
+    start->cid = dir;
+    cell = start->cell;
+    nid = start->nid;
+    while (cell) {
+        start->cell = cell;
+        while (CHILD_IS_NODE(nid)) {
+            start->nid = nid;
+            nid = NODE_CHILD(cell, nid, dir);
+        }
+        if (CHILD_IS_UOBJ(nid))
+            return ref_to_uobj(tree, cell->P[nid & INDEX_MASK]);
+        if (CHILD_IS_CELL(nid)) {
+            cell = cell_sub(cell, nid & INDEX_MASK);
+            nid = 0;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Go to either extreme of the tree.  Common code for first and last.
+ */
+static void *tree_extreme(c3bt_tree_impl *tree, c3bt_cursor *cur, int dir)
+{
+    c3bt_cursor_impl start;
+    void * robj;
+
+    if (!tree || !tree->root)
+        return NULL;
+    start.cell = tree->root;
+    start.nid = 0;
+    start.cid = 0;
+    if (tree->n_objects == 1) {
+        /* Singleton tree. */
+        robj = ref_to_uobj(tree, tree->root->P[0]);
+        goto done;
+    }
+    robj = tree_rush_down(tree, &start, dir);
+
+    done:
+
+    if (cur)
+        *(c3bt_cursor_impl*)cur = start;
+    return robj;
+}
+
+void *c3bt_first(c3bt_tree *c3bt, c3bt_cursor *cur)
+{
+    return tree_extreme((c3bt_tree_impl*)c3bt, cur, 0);
+}
+
+void *c3bt_last(c3bt_tree *c3bt, c3bt_cursor *cur)
+{
+    return tree_extreme((c3bt_tree_impl*)c3bt, cur, 1);
+}
+
+/*
+ * Step a cursor backwards or forwards.  Common for next() and prev().
+ */
+static void *tree_step(c3bt_tree_impl *tree, c3bt_cursor_impl *cur, int dir)
+{
+    c3bt_cell *cell;
+    void *uobj;
+    str_key skey, *sk;
+    int upper, lower, bit, cur_cbit;
+
+    /* Nowhere to step if tree is null, empty or singleton. */
+    if (!cur || !tree || tree->n_objects < 2)
+        return NULL;
+
+    /* The easy case: the other sibling is on the desired path. */
+    if (cur->cid != dir)
+        goto down;
+    /* The hard case: find an ancestor from where we can rush down.
+     * Climbing up is cell by cell using the parent pointer; within each
+     * cell it's key-guided descent.
+     */
+    cur_cbit = NODE_CBIT(cur->cell, cur->nid);
+    cell = cur->cell;
+    uobj = ref_to_uobj(tree,
+        cell->P[NODE_CHILD(cell, cur->nid, cur->cid) & INDEX_MASK]);
+    sk = key_sk(tree, (char*)uobj + tree->key_offset, &skey);
+    while (cell) {
+        lower = 0;
+        upper = INVALID_NODE;
+        while (CHILD_IS_NODE(lower)) {
+            if (NODE_CBIT(cell, lower) >= cur_cbit)
+                break;
+            bit = key_bit(tree, sk, (char*)uobj + tree->key_offset,
+                NODE_CBIT(cell, lower));
+            if (bit != dir)
+                upper = lower;
+            lower = NODE_CHILD(cell, lower, bit);
+        }
+        if (upper != INVALID_NODE) {
+            cur->cell = cell;
+            cur->nid = upper;
+            goto down;
+        }
+        cell = cell_parent(cell);
+    }
+    return NULL;
+
+    down:
+
+    lower = NODE_CHILD(cur->cell, cur->nid, dir);
+    if (CHILD_IS_UOBJ(lower)) {
+        cur->cid = dir;
+        return ref_to_uobj(tree, cur->cell->P[lower & INDEX_MASK]);
+    } else {
+        if (CHILD_IS_CELL(lower)) {
+            cur->cell = cell_sub(cur->cell, lower & INDEX_MASK);
+            cur->nid = 0;
+        } else
+            cur->nid = lower;
+        return tree_rush_down(tree, cur, 1 - dir);
+    }
+}
+
+/*
+ * Seek the nearest uobj to a key upwards (dir=1) or downwards (dir=0),
+ * including the uobj with the key itself or not.  Common for the bound and
+ * range functions.
+ *
+ * Lookup finds a leaf; if it's not the key, let d be their crit-bit.  All the
+ * uobjs under the first node on the path with cbit > d share the leaf's bits up
+ * to d, so the key sorts right before or right after all of them, depending on
+ * its own bit d.  Re-descend to that node and rush down to the near end.
+ */
+static void *tree_seek(c3bt_tree_impl *tree, void *key, c3bt_cursor *cur,
+    int dir, bool inclusive)
+{
+    c3bt_cursor_impl loc;
+    c3bt_cell *cell;
+    str_key skey, *sk;
+    void *robj;
+    int nid, cbit_nr, bit;
+
+    if (!tree || !key)
+        return NULL;
+    sk = key_sk(tree, key, &skey);
+    robj = tree_lookup(tree, tree_root(tree), key, sk, &loc);
+    if (!robj)
+        return NULL;
+    cbit_nr = key_crit(tree, key, sk, (char*)robj + tree->key_offset, NULL);
+    if (cbit_nr == -1) {
+        if (!inclusive)
+            robj = tree_step(tree, &loc, dir);
+        goto done;
+    }
+    bit = key_bit(tree, sk, key, cbit_nr);
+    if (tree->n_objects == 1) {
+        if (bit == dir)
+            robj = NULL;
+        goto done;
+    }
+    cell = tree->root;
+    nid = 0;
+    for (;;) {
+        if (CHILD_IS_CELL(nid)) {
+            cell = cell_sub(cell, nid & INDEX_MASK);
+            nid = 0;
+        } else if (CHILD_IS_UOBJ(nid) || NODE_CBIT(cell, nid) > cbit_nr)
+            break;
+        else
+            nid = NODE_CHILD(cell, nid,
+                key_bit(tree, sk, key, NODE_CBIT(cell, nid)));
+    }
+    /* If it's the leaf, loc is there already. */
+    if (!CHILD_IS_UOBJ(nid)) {
+        loc.cell = cell;
+        loc.nid = nid;
+        robj = tree_rush_down(tree, &loc, bit);
+    }
+    if (bit == dir)
+        robj = tree_step(tree, &loc, dir);
+
+    done:
+
+    if (cur)
+        *(c3bt_cursor_impl*)cur = loc;
+    return robj;
+}
+
+void *c3bt_lower_bound(c3bt_tree *c3bt, void *key, c3bt_cursor *cur)
+{
+    return tree_seek((c3bt_tree_impl*)c3bt, key, cur, 1, true);
+}
+
+void *c3bt_upper_bound(c3bt_tree *c3bt, void *key, c3bt_cursor *cur)
+{
+    return tree_seek((c3bt_tree_impl*)c3bt, key, cur, 1, false);
+}
+
+void *c3bt_floor(c3bt_tree *c3bt, void *key, c3bt_cursor *cur)
+{
+    return tree_seek((c3bt_tree_impl*)c3bt, key, cur, 0, true);
+}
+
+/*
+ * Range iteration.  The last uobj of the range is found up front, so each step
+ * is a plain next() and a pointer compare, and nothing past it is visited.
+ */
+void *c3bt_range_first(c3bt_tree *c3bt, void *lo, void *hi, c3bt_range *range)
+{
+    c3bt_tree_impl *tree;
+    str_key skey, *sk;
+    void *first;
+    int cbit_nr;
+
+    if (!c3bt || !range)
+        return NULL;
+    tree = (c3bt_tree_impl*)c3bt;
+    range->next = range->last = NULL;
+    if (lo)
+        first = tree_seek(tree, lo, &range->cur, 1, true);
+    else
+        first = tree_extreme(tree, &range->cur, 0);
+    if (!first)
+        return NULL;
+    if (hi) {
+        range->last = tree_seek(tree, hi, NULL, 0, true);
+        if (!range->last)
+            return NULL;
+        /* Empty if the first key >= lo is beyond hi. */
+        sk = key_sk(tree, (char*)first + tree->key_offset, &skey);
+        cbit_nr = key_crit(tree, (char*)first + tree->key_offset, sk, hi,
+            NULL);
+        if (cbit_nr >= 0 && key_bit(tree, sk, (char*)first + tree->key_offset,
+            cbit_nr))
+            return NULL;
+    }
+    range->next = first;
+    return c3bt_range_next(c3bt, range);
+}
+
+void *c3bt_range_next(c3bt_tree *c3bt, c3bt_range *range)
+{
+    void *robj;
+
+    if (!c3bt || !range || !range->next)
+        return NULL;
+    robj = range->next;
+    if (robj == range->last)
+        range->next = NULL;
+    else
+        range->next = tree_step((c3bt_tree_impl*)c3bt,
+            (c3bt_cursor_impl*)&range->cur, 1);
+    return robj;
+}
+
+/* Check if the first nbits of the key of uobj are those of prefix. */
+static bool key_has_prefix(c3bt_tree_impl *tree, void *prefix, uint nbits,
+    void *uobj)
+{
+    uint8_t *p, *k;
+    str_key skp, skk, *psk, *ksk;
+    uint i;
+    bool str = false;
+
+    p = prefix;
+    k = (uint8_t*)uobj + tree->key_offset;
+#ifdef C3BT_WITH_STRING
+    if (tree->key_type == C3BT_KDT_PSTR) {
+        p = *(uint8_t**)p;
+        k = *(uint8_t**)k;
+    }
+    str = tree->key_type == C3BT_KDT_PSTR || tree->key_type == C3BT_KDT_STR;
+#endif
+    if (str || tree->key_type == C3BT_KDT_BITS) {
+        for (i = 0; i < nbits / 8; i++) {
+            if (p[i] != k[i])
+                return false;
+            /* Both strings end within the prefix. */
+            if (str && !k[i])
+                return true;
+        }
+        return nbits % 8 == 0 || !((p[i] ^ k[i]) & (0xFF00 >> nbits % 8));
+    }
+    psk = key_sk(tree, prefix, &skp);
+    ksk = key_sk(tree, k, &skk);
+    for (i = 0; i < nbits; i++)
+        if (key_bit(tree, psk, prefix, i) != key_bit(tree, ksk, k, i))
+            return false;
+    return true;
+}
+
+/*
+ * Prefix enumeration.  Descend by the prefix while nodes test bits within it;
+ * all uobjs below the node where that stops share their first nbits, so one
+ * check tells if they are all in or all out, and the subtree's extremes bound
+ * the range.
+ */
+void *c3bt_prefix_first(c3bt_tree *c3bt, void *prefix, uint nbits,
+    c3bt_range *range)
+{
+    c3bt_tree_impl *tree;
+    c3bt_cursor_impl *loc;
+    c3bt_cursor_impl top;
+    c3bt_cell *cell;
+    str_key skey, *sk;
+    int nid, bit;
+
+    if (!c3bt || !prefix || !range)
+        return NULL;
+    tree = (c3bt_tree_impl*)c3bt;
+    range->next = range->last = NULL;
+    if (!tree->root)
+        return NULL;
+    loc = (c3bt_cursor_impl*)&range->cur;
+    loc->cell = tree->root;
+    loc->nid = 0;
+    loc->cid = 0;
+    if (tree->n_objects == 1) {
+        range->next = range->last = ref_to_uobj(tree, tree->root->P[0]);
+    } else {
+        sk = key_sk(tree, prefix, &skey);
+        cell = tree->root;
+        nid = 0;
+        for (;;) {
+            if (CHILD_IS_CELL(nid)) {
+                cell = cell_sub(cell, nid & INDEX_MASK);
+                nid = 0;
+            } else if (CHILD_IS_UOBJ(nid)
+                || NODE_CBIT(cell, nid) >= (int)nbits)
+                break;
+            else {
+                bit = key_bit(tree, sk, prefix, NODE_CBIT(cell, nid));
+                loc->cell = cell;
+                loc->nid = nid;
+                loc->cid = bit;
+                nid = NODE_CHILD(cell, nid, bit);
+            }
+        }
+        if (CHILD_IS_UOBJ(nid)) {
+            range->next = range->last = ref_to_uobj(tree,
+                cell->P[nid & INDEX_MASK]);
+        } else {
+            loc->cell = top.cell = cell;
+            loc->nid = top.nid = nid;
+            range->next = tree_rush_down(tree, loc, 0);
+            range->last = tree_rush_down(tree, &top, 1);
+        }
+    }
+    if (!key_has_prefix(tree, prefix, nbits, range->next))
+        range->next = range->last = NULL;
+    return c3bt_range_next(c3bt, range);
+}
+
+#ifdef C3BT_WITH_LPM
+/*
+ * Longest-prefix match.
+ *
+ * With the marker encoding, a prefix P/l is the leftmost leaf of the subtree
+ * holding the keys that start with P and a 1 at bit l.  If P covers the
+ * address, that subtree is either a path element of the address' lookup, or
+ * the sibling of one.  The leftmost leaf of a path element is the leaf itself
+ * or that of a sibling further down, so checking the leaf and the leftmost
+ * leaf of each sibling covers all the candidates.  A candidate hanging off a
+ * node with cbit c is at most c bits long; going bottom-up, stop once the best
+ * match is that long.
+ */
+typedef struct lpm_step {
+    c3bt_cell *cell;
+    int nid;
+    int cbit;
+} lpm_step;
+
+/* Return the prefix length of uobj if it covers the address in q, or -1. */
+static int lpm_cover_len(c3bt_tree_impl *tree, void *uobj, void *q)
+{
+    void *key;
+    int len, cbit_nr;
+
+    key = (char*)uobj + tree->key_offset;
+    if (tree->key_type == C3BT_KDT_LPM32)
+        len = ((c3bt_prefix32*)key)->len > 32 ? 32
+            : ((c3bt_prefix32*)key)->len;
+    else
+        len = ((c3bt_prefix128*)key)->len > 128 ? 128
+            : ((c3bt_prefix128*)key)->len;
+    cbit_nr = tree->bitops(-(tree->key_nbits + 1), key, q);
+    return cbit_nr == -1 || cbit_nr >= len ? len : -1;
+}
+
+void *c3bt_lpm(c3bt_tree *c3bt, void *addr)
+{
+    c3bt_tree_impl *tree;
+    c3bt_prefix32 q32;
+    c3bt_prefix128 q128;
+    c3bt_cursor_impl start;
+    lpm_step path[129];
+    c3bt_cell *cell;
+    void *q, *robj, *best;
+    int nid, depth, len, best_len;
+
+    if (!c3bt || !addr)
+        return NULL;
+    tree = (c3bt_tree_impl*)c3bt;
+    if (tree->key_type == C3BT_KDT_LPM32) {
+        q32.addr = *(uint32_t*)addr;
+        q32.len = 32;
+        q = &q32;
+    } else if (tree->key_type == C3BT_KDT_LPM128) {
+        memcpy(q128.addr, addr, 16);
+        q128.len = 128;
+        q = &q128;
+    } else
+        return NULL;
+    cell = tree_root(tree);
+    if (!cell)
+        return NULL;
+    if (cell_is_singleton(cell)) {
+        robj = ref_to_uobj(tree, cell->P[0]);
+        return lpm_cover_len(tree, robj, q) >= 0 ? robj : NULL;
+    }
+
+    nid = depth = 0;
+    while (!CHILD_IS_UOBJ(nid)) {
+        if (CHILD_IS_CELL(nid)) {
+            cell = cell_sub(cell, nid & INDEX_MASK);
+            nid = 0;
+            continue;
+        }
+        path[depth].cell = cell;
+        path[depth].nid = nid;
+        path[depth].cbit = NODE_CBIT(cell, nid);
+        depth++;
+        nid = NODE_CHILD(cell, nid, tree->bitops(NODE_CBIT(cell, nid), q,
+            NULL));
+    }
+    best = ref_to_uobj(tree, cell->P[nid & INDEX_MASK]);
+    best_len = lpm_cover_len(tree, best, q);
+    while (depth-- && best_len < path[depth].cbit) {
+        cell = path[depth].cell;
+        nid = NODE_CHILD(cell, path[depth].nid,
+            1 - tree->bitops(path[depth].cbit, q, NULL));
+        if (CHILD_IS_UOBJ(nid))
+            robj = ref_to_uobj(tree, cell->P[nid & INDEX_MASK]);
+        else {
+            start.cell = CHILD_IS_CELL(nid) ? cell_sub(cell, nid & INDEX_MASK)
+                : cell;
+            start.nid = CHILD_IS_CELL(nid) ? 0 : nid;
+            robj = tree_rush_down(tree, &start, 0);
+        }
+        len = lpm_cover_len(tree, robj, q);
+        if (len > best_len) {
+            best = robj;
+            best_len = len;
+        }
+    }
+    return best_len >= 0 ? best : NULL;
+}
+#endif
+
+void *c3bt_prev(c3bt_tree *c3bt, c3bt_cursor *cur)
+{
+    return tree_step((c3bt_tree_impl*)c3bt, (c3bt_cursor_impl*)cur, 0);
+}
+
+void *c3bt_next(c3bt_tree *c3bt, c3bt_cursor *cur)
+{
+    return tree_step((c3bt_tree_impl*)c3bt, (c3bt_cursor_impl*)cur, 1);
+}
+
+#ifdef C3BT_WITH_THREADS
+/*
+ * Single writer, concurrent readers.
+ *
+ * The writer never changes a cell that readers can reach, except for the
+ * parent pointers, which lookups don't follow.  The first change to a cell in
+ * an add or remove goes to a private copy of it (cell_cow()), which is linked
+ * to the private copies of its parent and sub-cells, if any, so all the cells
+ * changed form a private subtree.  Once the change is done, the top of that
+ * subtree takes the place of the original in the live parent's pointer slot
+ * (or as the root) by one release store, and the originals are retired.
+ *
+ * Epoch based reclamation: each reader posts the global epoch when it enters a
+ * read-side section and clears it when it leaves.  The epoch is advanced when
+ * enough cells have been retired; a cell retired in epoch e is freed once no
+ * reader posts an epoch <= e, since readers entering later can't reach it.
+ *
+ * Concurrent writers (see c3bt_rcu_writers()) post epochs as readers do, and
+ * each change locks the live cells it copies or drops together with their
+ * parents (the root slot for the root cell), where the copies are published.
+ * Private cells are locked too, as live cells may point to them as parent for
+ * a while.  Since live cells don't change but for the publishing stores, a
+ * writer finds its cells without locks, like a reader, and checks them once
+ * locked: a cell is still in the tree if its parent pointer is unchanged and
+ * the parent is too, as a retired cell is marked by pointing to itself.  Locks
+ * are only tried; when one is busy or a cell is gone, the change is undone and
+ * redone after the lock is free, so there's no lock order to keep.  The locks
+ * are kept in a table hashed by cell address rather than in the cells, which
+ * the readers share.
+ */
+#define RCU_BATCH           64 /* retired cells to try reclaiming. */
+#define RCU_LOCKS           4096 /* cell locks, then the root slot lock. */
+#define RCU_SPARE           32 /* free cells cached by a writer. */
+#define RCU_SPIN            64 /* spins before yielding the CPU. */
+
+typedef struct rcu_copy {
+    c3bt_cell *orig; /* the live cell, or NULL for a new one. */
+    c3bt_cell *copy; /* its private copy, or NULL if dropped. */
+} rcu_copy;
+
+typedef struct rcu_retired {
+    c3bt_cell *cell;
+    uint64_t epoch; /* the epoch it was retired in. */
+} rcu_retired;
+
+typedef struct rcu_slot {
+    uint64_t epoch; /* posted by the reader; 0 if not in a section. */
+    uint64_t reserved[7]; /* a cache line each. */
+} rcu_slot;
+
+struct rcu_writer {
+    rcu_copy *copies; /* cells of the change being made. */
+    rcu_retired *retired;
+    uint32_t **held; /* locks held by the change. */
+    uint32_t *busy; /* the lock which stopped the change, if any. */
+    size_t nretired;
+    size_t retired_size;
+    size_t reclaim_at; /* try reclaiming when nretired gets here. */
+    int ncopies;
+    int copies_size;
+    int nheld;
+    int held_size;
+    int slot; /* the epoch slot. */
+    int nspare;
+    c3bt_cell *spare[RCU_SPARE]; /* freed cells, with concurrent writers. */
+};
+
+typedef struct rcu_state {
+    /* Read by the readers, in a cache line of their own. */
+    uint64_t epoch; /* the global epoch, from 1 on. */
+    rcu_slot *slots; /* one per reader, then one per writer. */
+    int nreaders;
+#ifdef _LP64
+    int reserved[11];
+#else
+    int reserved[12];
+#endif
+    /* Writers only. */
+    rcu_writer **writers;
+    uint32_t *locks; /* with concurrent writers. */
+    uint32_t alloc_lock; /* of the cell storage. */
+    int nwriters;
+    uint64_t removes; /* begun, with concurrent writers. */
+    uint64_t removed; /* done, or given up. */
+} rcu_state;
+
+/* A writer's state, in cache lines of its own. */
+static rcu_writer *rcu_writer_new(int slot)
+{
+    rcu_writer *w;
+    void *mem;
+
+    if (posix_memalign(&mem, 64, (sizeof(rcu_writer) + 63) & ~63))
+        return NULL;
+    w = mem;
+    memset(w, 0, sizeof(rcu_writer));
+    w->reclaim_at = RCU_BATCH;
+    w->slot = slot;
+    return w;
+}
+
+static void rcu_writer_free(rcu_writer *w)
+{
+    if (!w)
+        return;
+    free(w->copies);
+    free(w->retired);
+    free(w->held);
+    free(w);
+}
+
+bool c3bt_rcu_enable(c3bt_tree *c3bt, int nreaders)
+{
+    c3bt_tree_impl *tree;
+    rcu_state *rcu;
+    void *mem;
+
+    if (!c3bt || nreaders <= 0)
+        return false;
+    tree = (c3bt_tree_impl*)c3bt;
+    if (tree->rcu)
+        return false;
+    if (posix_memalign(&mem, 64, sizeof(rcu_state)))
+        return false;
+    rcu = mem;
+    memset(rcu, 0, sizeof(rcu_state));
+    rcu->writers = malloc(sizeof(rcu_writer*));
+    if (!rcu->writers)
+        goto fail;
+    rcu->writers[0] = rcu_writer_new(nreaders);
+    if (!rcu->writers[0])
+        goto fail;
+    /* The writer's slot is only used with others. */
+    if (posix_memalign(&mem, 64, (nreaders + 1) * sizeof(rcu_slot)))
+        goto fail;
+    rcu->slots = mem;
+    memset(rcu->slots, 0, (nreaders + 1) * sizeof(rcu_slot));
+    rcu->nreaders = nreaders;
+    rcu->nwriters = 1;
+    rcu->epoch = 1;
+    tree->rcu = rcu;
+    return true;
+
+    fail:
+
+    if (rcu->writers)
+        rcu_writer_free(rcu->writers[0]);
+    free(rcu->writers);
+    free(rcu);
+    return false;
+}
+
+bool c3bt_rcu_writers(c3bt_tree *c3bt, int nwriters)
+{
+    rcu_state *rcu;
+    rcu_writer **writers;
+    uint32_t *locks;
+    void *mem;
+    int i;
+
+    if (!c3bt || !((c3bt_tree_impl*)c3bt)->rcu)
+        return false;
+    rcu = ((c3bt_tree_impl*)c3bt)->rcu;
+    if (rcu->nwriters > 1 || nwriters < 1)
+        return false;
+    if (nwriters == 1)
+        return true;
+    writers = calloc(nwriters, sizeof(rcu_writer*));
+    locks = calloc(RCU_LOCKS + 1, sizeof(uint32_t));
+    if (!writers || !locks)
+        goto fail;
+    for (i = 1; i < nwriters; i++) {
+        writers[i] = rcu_writer_new(rcu->nreaders + i);
+        if (!writers[i])
+            goto fail;
+    }
+    if (posix_memalign(&mem, 64, (rcu->nreaders + nwriters) * sizeof(rcu_slot)))
+        goto fail;
+    memset(mem, 0, (rcu->nreaders + nwriters) * sizeof(rcu_slot));
+    free(rcu->slots);
+    rcu->slots = mem;
+    writers[0] = rcu->writers[0];
+    free(rcu->writers);
+    rcu->writers = writers;
+    rcu->locks = locks;
+    rcu->nwriters = nwriters;
+    return true;
+
+    fail:
+
+    if (writers)
+        for (i = 1; i < nwriters; i++)
+            rcu_writer_free(writers[i]);
+    free(writers);
+    free(locks);
+    return false;
+}
+
+/*
+ * The fence orders the posted epoch before the loads of the tree, against the
+ * writer's fence between publishing and checking the readers: either the
+ * writer sees the epoch, or the reader sees the published cells.
+ */
+void c3bt_read_lock(c3bt_tree *c3bt, int reader)
+{
+    rcu_state *rcu = ((c3bt_tree_impl*)c3bt)->rcu;
+
+    __atomic_store_n(&rcu->slots[reader].epoch,
+        __atomic_load_n(&rcu->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void c3bt_read_unlock(c3bt_tree *c3bt, int reader)
+{
+    rcu_state *rcu = ((c3bt_tree_impl*)c3bt)->rcu;
+
+    __atomic_store_n(&rcu->slots[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Release the state; the retired and spare cells go with the cell storage. */
+static void rcu_destroy(c3bt_tree_impl *tree)
+{
+    int i;
+
+    if (!tree->rcu)
+        return;
+    for (i = 0; i < tree->rcu->nwriters; i++)
+        rcu_writer_free(tree->rcu->writers[i]);
+    free(tree->rcu->writers);
+    free(tree->rcu->locks);
+    free(tree->rcu->slots);
+    free(tree->rcu);
+    tree->rcu = NULL;
+}
+
+/* Forget the retired and spare cells when the cell storage is replaced. */
+static void rcu_forget(c3bt_tree_impl *tree)
+{
+    int i;
+
+    if (!tree->rcu)
+        return;
+    for (i = 0; i < tree->rcu->nwriters; i++) {
+        tree->rcu->writers[i]->nretired = 0;
+        tree->rcu->writers[i]->nspare = 0;
+    }
+}
+
+static rcu_writer *rcu_writer_of(c3bt_tree_impl *tree, int writer)
+{
+    return tree->rcu ? tree->rcu->writers[writer] : NULL;
+}
+
+/* With concurrent writers, the writer's epoch is posted during a change. */
+static void rcu_enter(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    if (!w)
+        return;
+    w->busy = NULL;
+    if (tree->rcu->nwriters > 1)
+        c3bt_read_lock((c3bt_tree*)tree, w->slot);
+}
+
+static void rcu_exit(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    if (w && tree->rcu->nwriters > 1)
+        c3bt_read_unlock((c3bt_tree*)tree, w->slot);
+}
+
+static void rcu_spin_lock(uint32_t *lock)
+{
+    int n;
+
+    for (n = 0; __atomic_load_n(lock, __ATOMIC_RELAXED)
+        || __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE); n++)
+        if (n >= RCU_SPIN)
+            sched_yield();
+}
+
+/* The lock of a cell, or of the root slot for NULL. */
+static uint32_t *rcu_cell_lock(rcu_state *rcu, c3bt_cell *cell)
+{
+    if (!cell)
+        return rcu->locks + RCU_LOCKS;
+    return rcu->locks + ((uintptr_t)cell / C3BT_CELL_SIZE & (RCU_LOCKS - 1));
+}
+
+/*
+ * Try a lock for the change, unless it's held already (cells may share one).
+ * Fail if busy, or no memory.
+ */
+static bool rcu_lock(rcu_writer *w, uint32_t *lock)
+{
+    uint32_t **tmp;
+    int i, size;
+
+    for (i = 0; i < w->nheld; i++)
+        if (w->held[i] == lock)
+            return true;
+    if (w->nheld == w->held_size) {
+        size = w->held_size ? w->held_size * 2 : 16;
+        tmp = realloc(w->held, size * sizeof(uint32_t*));
+        if (!tmp)
+            return false;
+        w->held = tmp;
+        w->held_size = size;
+    }
+    if (__atomic_load_n(lock, __ATOMIC_RELAXED)
+        || __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        w->busy = lock;
+        return false;
+    }
+    w->held[w->nheld++] = lock;
+    return true;
+}
+
+static void rcu_unlock(rcu_writer *w)
+{
+    while (w->nheld)
+        __atomic_store_n(w->held[--w->nheld], 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Lock a live cell and its parent for the change, and check that it's still in
+ * the tree.  Nothing to do for a single writer.
+ */
+static bool rcu_hold(c3bt_tree_impl *tree, rcu_writer *w, c3bt_cell *cell)
+{
+    rcu_state *rcu = tree->rcu;
+    c3bt_cell *parent;
+
+    if (!w || rcu->nwriters == 1)
+        return true;
+    parent = cell_parent(cell);
+    if (parent == cell)
+        goto gone;
+    if (!rcu_lock(w, rcu_cell_lock(rcu, parent))
+        || !rcu_lock(w, rcu_cell_lock(rcu, cell)))
+        return false;
+    if (cell_parent(cell) == parent
+        && (parent ? cell_parent(parent) != parent : tree->root == cell))
+        return true;
+
+    gone:
+
+    w->busy = rcu_cell_lock(rcu, cell);
+    return false;
+}
+
+/* Lock the root slot of an empty tree, and check that it still is. */
+static bool rcu_hold_empty(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    rcu_state *rcu = tree->rcu;
+
+    if (!w || rcu->nwriters == 1)
+        return true;
+    if (!rcu_lock(w, rcu_cell_lock(rcu, NULL)))
+        return false;
+    if (!tree->root)
+        return true;
+    w->busy = rcu_cell_lock(rcu, NULL);
+    return false;
+}
+
+/*
+ * Whether to redo a failed change: it was stopped by another writer, not by
+ * lack of memory.  Wait until that one is done, out of the epoch.
+ */
+static bool rcu_retry(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    int n;
+
+    if (!w || !w->busy)
+        return false;
+    rcu_exit(tree, w);
+    for (n = 0; __atomic_load_n(w->busy, __ATOMIC_RELAXED); n++)
+        if (n >= RCU_SPIN)
+            sched_yield();
+    rcu_enter(tree, w);
+    return true;
+}
+
+/*
+ * An add places its node by a lookup, which a concurrent remove can make stale
+ * without touching the cells the add changes.  So removes are counted, and an
+ * add is redone unless none was under way from its lookup to its insertion.
+ */
+static uint64_t rcu_removes_done(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    if (!w || tree->rcu->nwriters == 1)
+        return 0;
+    return __atomic_load_n(&tree->rcu->removed, __ATOMIC_ACQUIRE);
+}
+
+static bool rcu_removes_quiet(c3bt_tree_impl *tree, rcu_writer *w,
+    uint64_t done)
+{
+    if (!w || tree->rcu->nwriters == 1)
+        return true;
+    return __atomic_load_n(&tree->rcu->removes, __ATOMIC_ACQUIRE) == done;
+}
+
+/* After rcu_abort(): wait out the removes under way, out of the epoch. */
+static void rcu_removes_wait(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    rcu_state *rcu = tree->rcu;
+    int n;
+
+    rcu_exit(tree, w);
+    for (n = 0; __atomic_load_n(&rcu->removed, __ATOMIC_ACQUIRE)
+        != __atomic_load_n(&rcu->removes, __ATOMIC_ACQUIRE); n++)
+        if (n >= RCU_SPIN)
+            sched_yield();
+    rcu_enter(tree, w);
+}
+
+static void rcu_remove_begin(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    if (w && tree->rcu->nwriters > 1)
+        __atomic_fetch_add(&tree->rcu->removes, 1, __ATOMIC_SEQ_CST);
+}
+
+static void rcu_remove_end(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    if (w && tree->rcu->nwriters > 1)
+        __atomic_fetch_add(&tree->rcu->removed, 1, __ATOMIC_RELEASE);
+}
+
+/* Get a cell for the change; it's locked with concurrent writers. */
+static c3bt_cell *rcu_alloc(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    rcu_state *rcu = tree->rcu;
+    c3bt_cell *cell;
+
+    if (rcu->nwriters == 1)
+        return cell_malloc(tree);
+    if (w->nspare) {
+        cell = w->spare[--w->nspare];
+        cell_clear(cell);
+    } else {
+        rcu_spin_lock(&rcu->alloc_lock);
+        cell = cell_malloc(tree);
+        __atomic_store_n(&rcu->alloc_lock, 0, __ATOMIC_RELEASE);
+        if (!cell)
+            return NULL;
+    }
+    if (!rcu_lock(w, rcu_cell_lock(rcu, cell))) {
+        w->spare[w->nspare++] = cell;
+        return NULL;
+    }
+    return cell;
+}
+
+static void rcu_free(c3bt_tree_impl *tree, rcu_writer *w, c3bt_cell *cell)
+{
+    rcu_state *rcu = tree->rcu;
+
+    if (rcu->nwriters == 1) {
+        cell_free(tree, cell);
+        return;
+    }
+    if (w->nspare == RCU_SPARE) {
+        rcu_spin_lock(&rcu->alloc_lock);
+        while (w->nspare > RCU_SPARE / 2)
+            cell_free(tree, w->spare[--w->nspare]);
+        __atomic_store_n(&rcu->alloc_lock, 0, __ATOMIC_RELEASE);
+    }
+    w->spare[w->nspare++] = cell;
+}
+
+/*
+ * Record a cell of the change, with room to retire it.  An entry is kept
+ * spare, so that dropping a live cell (always after a copy) never fails.
+ */
+static bool rcu_record(rcu_writer *w, c3bt_cell *orig, c3bt_cell *copy)
+{
+    rcu_retired *retired;
+    rcu_copy *copies;
+    size_t n;
+    int size;
+
+    n = w->nretired + w->ncopies + 2;
+    if (n > w->retired_size) {
+        retired = realloc(w->retired, n * 2 * sizeof(rcu_retired));
+        if (!retired)
+            return false;
+        w->retired = retired;
+        w->retired_size = n * 2;
+    }
+    if (w->ncopies + 2 > w->copies_size) {
+        size = w->copies_size ? w->copies_size * 2 : 16;
+        copies = realloc(w->copies, size * sizeof(rcu_copy));
+        if (!copies)
+            return false;
+        w->copies = copies;
+        w->copies_size = size;
+    }
+    w->copies[w->ncopies].orig = orig;
+    w->copies[w->ncopies].copy = copy;
+    w->ncopies++;
+    return true;
+}
+
+/* The private version of a cell, which may be the cell itself, or NULL. */
+static c3bt_cell *rcu_private(rcu_writer *w, c3bt_cell *cell)
+{
+    int i;
+
+    if (cell)
+        for (i = 0; i < w->ncopies; i++)
+            if (w->copies[i].copy == cell || w->copies[i].orig == cell)
+                return w->copies[i].copy;
+    return NULL;
+}
+
+/* The pointer index of a sub-cell. */
+static int cell_find_ref(c3bt_cell *cell, c3bt_cell *sub)
+{
+    c3bt_ref ref = cell_to_ref(sub);
+    int i;
+
+    for (i = 0; cell->P[i] != ref; i++)
+        /* nothing */;
+    return i;
+}
+
+/*
+ * Get a cell to change: a private copy of it in a concurrent tree, or the cell
+ * itself.  Return NULL if no memory, or if another writer is in the way.
+ */
+static c3bt_cell *cell_cow(c3bt_tree_impl *tree, rcu_writer *w,
+    c3bt_cell *cell)
+{
+    c3bt_cell *copy, *other;
+    uint8_t pids[NODES_PER_CELL + 1];
+    int n;
+
+    if (!w)
+        return cell;
+    /* The copy and its links are private until the change is published. */
+    copy = rcu_private(w, cell);
+    if (copy)
+        return copy;
+    if (!rcu_hold(tree, w, cell))
+        return NULL;
+    copy = rcu_alloc(tree, w);
+    if (!copy)
+        return NULL;
+    if (!rcu_record(w, cell, copy)) {
+        rcu_free(tree, w, copy);
+        return NULL;
+    }
+    memcpy(copy, cell, sizeof(c3bt_cell));
+    /* Link it with the private parent and sub-cells. */
+    other = rcu_private(w, cell_parent(cell));
+    if (other) {
+        other->P[cell_find_ref(other, cell)] = cell_to_ref(copy);
+        cell_set_parent(copy, other);
+    }
+    n = cell_subcells(copy, pids);
+    while (n--) {
+        other = rcu_private(w, cell_sub(copy, pids[n]));
+        if (other) {
+            copy->P[pids[n]] = cell_to_ref(other);
+            cell_set_parent(other, copy);
+        }
+    }
+    return copy;
+}
+
+/* Get a new cell for the change. */
+static c3bt_cell *cell_new(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    c3bt_cell *cell;
+
+    if (!w)
+        return cell_malloc(tree);
+    cell = rcu_alloc(tree, w);
+    if (cell && !rcu_record(w, NULL, cell)) {
+        rcu_free(tree, w, cell);
+        return NULL;
+    }
+    return cell;
+}
+
+/*
+ * Free a cell taken out of the tree by the change.  A live one must have been
+ * held (see rcu_hold()).
+ */
+static void cell_drop(c3bt_tree_impl *tree, rcu_writer *w, c3bt_cell *cell)
+{
+    int i;
+
+    if (!w) {
+        cell_free(tree, cell);
+        return;
+    }
+    for (i = 0; i < w->ncopies; i++)
+        if (w->copies[i].copy == cell) {
+            w->copies[i].copy = NULL;
+            rcu_free(tree, w, cell);
+            return;
+        }
+    /* A live one: it's retired with the others. */
+    w->copies[w->ncopies].orig = cell;
+    w->copies[w->ncopies].copy = NULL;
+    w->ncopies++;
+}
+
+/* Point the sub-cells of a cell back to it. */
+static void cell_adopt_subcells(c3bt_cell *cell)
+{
+    uint8_t pids[NODES_PER_CELL + 1];
+    c3bt_cell *sub;
+    int n;
+
+    n = cell_subcells(cell, pids);
+    while (n--) {
+        sub = cell_sub(cell, pids[n]);
+        /* NULL in a singleton. */
+        if (sub)
+            cell_set_parent(sub, cell);
+    }
+}
+
+/* Undo the change: the live cells are as they were, except parent pointers. */
+static void rcu_abort(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    int i;
+
+    if (!w)
+        return;
+    for (i = 0; i < w->ncopies; i++) {
+        if (w->copies[i].orig)
+            cell_adopt_subcells(w->copies[i].orig);
+        if (w->copies[i].copy)
+            rcu_free(tree, w, w->copies[i].copy);
+    }
+    w->ncopies = 0;
+    rcu_unlock(w);
+}
+
+/* Advance the epoch and free the cells no reader can see any more. */
+static void rcu_reclaim(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    rcu_state *rcu = tree->rcu;
+    uint64_t oldest, epoch;
+    size_t i, n;
+    int r;
+
+    oldest = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r = 0; r < rcu->nreaders + rcu->nwriters; r++) {
+        epoch = __atomic_load_n(&rcu->slots[r].epoch, __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+    for (i = n = 0; i < w->nretired; i++) {
+        if (w->retired[i].epoch < oldest)
+            rcu_free(tree, w, w->retired[i].cell);
+        else
+            w->retired[n++] = w->retired[i];
+    }
+    w->nretired = n;
+    w->reclaim_at = n + RCU_BATCH;
+}
+
+/* Publish the change and retire the cells it replaced. */
+static void rcu_commit(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    rcu_state *rcu = tree->rcu;
+    rcu_copy *c;
+    c3bt_cell *parent;
+    uint64_t epoch;
+    int i;
+
+    if (!w)
+        return;
+    for (i = 0; i < w->ncopies; i++)
+        if (w->copies[i].copy)
+            cell_adopt_subcells(w->copies[i].copy);
+    for (i = 0; i < w->ncopies; i++) {
+        c = w->copies + i;
+        if (!c->orig || !c->copy)
+            continue;
+        parent = cell_parent(c->copy);
+        if (!parent)
+            tree_set_root(tree, c->copy);
+        else if (!rcu_private(w, parent))
+            __atomic_store_n(&parent->P[cell_find_ref(parent, c->orig)],
+                cell_to_ref(c->copy), __ATOMIC_RELEASE);
+    }
+    if (rcu->nwriters > 1) {
+        /* Mark the retired cells for the other writers, then take the epoch
+         * after the publishing stores, which it may have passed.
+         */
+        for (i = 0; i < w->ncopies; i++)
+            if (w->copies[i].orig)
+                cell_set_parent(w->copies[i].orig, w->copies[i].orig);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_RELAXED);
+    for (i = 0; i < w->ncopies; i++)
+        if (w->copies[i].orig) {
+            w->retired[w->nretired].cell = w->copies[i].orig;
+            w->retired[w->nretired].epoch = epoch;
+            w->nretired++;
+        }
+    w->ncopies = 0;
+    rcu_unlock(w);
+    if (w->nretired >= w->reclaim_at)
+        rcu_reclaim(tree, w);
+}
+#else
+static void rcu_destroy(c3bt_tree_impl *tree)
+{
+}
+
+static void rcu_forget(c3bt_tree_impl *tree)
+{
+}
+
+static rcu_writer *rcu_writer_of(c3bt_tree_impl *tree, int writer)
+{
+    return NULL;
+}
+
+static void rcu_enter(c3bt_tree_impl *tree, rcu_writer *w)
+{
+}
+
+static void rcu_exit(c3bt_tree_impl *tree, rcu_writer *w)
+{
+}
+
+static bool rcu_hold(c3bt_tree_impl *tree, rcu_writer *w, c3bt_cell *cell)
+{
+    return true;
+}
+
+static bool rcu_hold_empty(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    return true;
+}
+
+static bool rcu_retry(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    return false;
+}
+
+static uint64_t rcu_removes_done(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    return 0;
+}
+
+static bool rcu_removes_quiet(c3bt_tree_impl *tree, rcu_writer *w,
+    uint64_t done)
+{
+    return true;
+}
+
+static void rcu_removes_wait(c3bt_tree_impl *tree, rcu_writer *w)
+{
+}
+
+static void rcu_remove_begin(c3bt_tree_impl *tree, rcu_writer *w)
+{
+}
+
+static void rcu_remove_end(c3bt_tree_impl *tree, rcu_writer *w)
+{
+}
+
+static c3bt_cell *cell_cow(c3bt_tree_impl *tree, rcu_writer *w,
+    c3bt_cell *cell)
+{
+    return cell;
+}
+
+static c3bt_cell *cell_new(c3bt_tree_impl *tree, rcu_writer *w)
+{
+    return cell_malloc(tree);
+}
+
+static void cell_drop(c3bt_tree_impl *tree, rcu_writer *w, c3bt_cell *cell)
+{
+    cell_free(tree, cell);
+}
+
+static void rcu_abort(c3bt_tree_impl *tree, rcu_writer *w)
+{
+}
+
+static void rcu_commit(c3bt_tree_impl *tree, rcu_writer *w)
+{
+}
+#endif
+
+/*
+ * Find node's parent in a cell.
+ *
+ * Return value is in the form of parent_node_id<<1|which_child_i_am.  Note:
+ * input can't be 0.
+ */
+static int cell_node_parent(c3bt_cell *cell, int node)
+{
+#ifdef C3BT_SOA
+    return cell_child_locate(__builtin_ctz(cell_child_match(cell, 0xFF, node)));
+#else
+    int n, c;
+
+    for (n = 0; n < NODES_PER_CELL; n++) {
+        if (cell_node_is_vacant(cell, n))
+            continue;
+        for (c = 0; c < 2; c++)
+            if (NODE_CHILD(cell, n, c) == node)
+                goto found;
+    }
+
+    found:
+
+    return n << 1 | c;
+#endif
+}
+
+/*
+ * Find a split point for a fully populated cell.  Return the would-be new cell
+ * root and a bitmap representing the nodes to be moved.
+ */
+static uint cell_find_split(c3bt_cell *cell, int *bitmap)
+{
+    uint8_t stack[NODES_PER_CELL - 2];
+    int i, top, n, c, count, ret_n, ret_bmp, offset;
+#ifdef C3BT_SOA
+    uint inner;
+
+    /* Nodes with at least one node child; the cell is full. */
+    inner = cell_child_bits(cell, FLAGS_MASK, 0);
+    inner = (inner | inner >> NODES_PER_CELL) & NODE_BITS_MASK;
+#endif
+
+    ret_n = ret_bmp = 0; /* shut compiler up. */
+    offset = NODES_PER_CELL;
+    for (i = NODES_PER_CELL - 1; i > 0; i--) {
+#ifdef C3BT_SOA
+        if (!(inner & (1u << i)))
+            continue;
+#else
+        if (!CHILD_IS_NODE(NODE_CHILD(cell, i, 0))
+            && !CHILD_IS_NODE(NODE_CHILD(cell, i, 1)))
+            continue;
+#endif
+        /* Pre-order traversal to count nodes in a subtree.  Cell-root and edge
+         * nodes are excluded.
+         */
+        count = 1;
+        *bitmap = 0;
+        stack[0] = i;
+        top = 0;
+        while (top >= 0) {
+            n = stack[top--];
+            *bitmap |= 0x8000u >> n;
+            for (c = 1; c >= 0; c--)
+                if (CHILD_IS_NODE(NODE_CHILD(cell, n, c))) {
+                    stack[++top] = NODE_CHILD(cell, n, c);
+                    count++;
+                }
+        }
+        /* Calculate deviation from perfect split. */
+        c = count * 2 - NODES_PER_CELL;
+        c = __builtin_abs(c);
+        if (c == NODES_PER_CELL % 2)
+            return i;
+        if (c < offset) {
+            offset = c;
+            ret_n = i;
+            ret_bmp = *bitmap;
+        }
+    }
+    *bitmap = ret_bmp;
+    return ret_n;
+}
+
+/*
+ * Split a full cell in two.  New cell will become original cell's sub-cell.
+ */
+static bool cell_split(c3bt_tree_impl *tree, rcu_writer *w, c3bt_cell *cell)
+{
+    c3bt_cell *new_cell;
+    int i, c, p, anchor, new_root, count, bitmap;
+
+    new_cell = cell_new(tree, w);
+    if (!new_cell)
+        return false;
+
+    new_root = cell_find_split(cell, &bitmap);
+    count = 0;
+    for (i = 0; i < NODES_PER_CELL; i++) {
+        if (!(bitmap & (0x8000u >> i)))
+            continue;
+        /* Move node[i] and its children to new cell (same location) */
+        cell_copy_node(new_cell, i, cell, i);
+        cell_take_node(new_cell, i);
+        for (c = 0; c < 2; c++) {
+            p = NODE_CHILD(cell, i, c);
+            if (!CHILD_IS_NODE(p)) {
+                if (CHILD_IS_CELL(p))
+                    cell_set_parent(cell_sub(cell, p & INDEX_MASK), new_cell);
+                p &= INDEX_MASK;
+                new_cell->P[p] = cell->P[p];
+                cell_take_ptr(new_cell, p);
+                cell_free_ptr(cell, p);
+            }
+        }
+        count++;
+        cell_free_node(cell, i);
+    }
+
+    /* Fix old cell. */
+    p = cell_alloc_ptr(cell);
+    cell->P[p] = cell_to_ref(new_cell);
+    anchor = cell_node_parent(cell, new_root);
+    NODE_CHILD(cell, anchor >> 1, anchor & 1) = CHILD_CELL_BIT | p;
+    cell_dec_ncount(cell, count);
+
+    /* Fix new cell. */
+    cell_copy_node(new_cell, 0, new_cell, new_root);
+    cell_take_node(new_cell, 0);
+    cell_free_node(new_cell, new_root);
+    new_cell->pnc = cell_make_pnc(cell, count);
+    return true;
+}
+
+/*
+ * Try to push down a node from a full cell.
+ */
+static bool cell_push_down(c3bt_tree_impl *tree, rcu_writer *w,
+    c3bt_cell *cell)
+{
+    int n, np, c, sibling, old_root, new_ptr;
+    c3bt_cell *sub;
+
+    for (n = 1; n < NODES_PER_CELL; n++) {
+        /* All nodes are taken, no need for vacancy test.*/
+        for (c = 0; c < 2; c++) {
+            /* Only edge nodes can be pushed down. */
+            if (CHILD_IS_CELL(NODE_CHILD(cell, n, c))
+                && !CHILD_IS_NODE(NODE_CHILD(cell, n, 1 - c))) {
+                sub = cell_sub(cell, NODE_CHILD(cell, n, c) & INDEX_MASK);
+                if (cell_ncount(sub) < NODES_PER_CELL) {
+                    sub = cell_cow(tree, w, sub);
+                    if (!sub)
+                        return false;
+                    sibling = NODE_CHILD(cell, n, 1 - c);
+                    old_root = cell_alloc_node(sub);
+                    new_ptr = cell_alloc_ptr(sub);
+                    cell_inc_ncount(sub, 1);
+                    np = cell_node_parent(cell, n);
+                    NODE_CHILD(cell, np >> 1, np & 1) = NODE_CHILD(cell, n, c);
+                    cell_copy_node(sub, old_root, sub, 0);
+                    sub->P[new_ptr] = cell->P[sibling & INDEX_MASK];
+                    NODE_CBIT(sub, 0) = NODE_CBIT(cell, n);
+                    NODE_CHILD(sub, 0, c) = old_root;
+                    NODE_CHILD(sub, 0, 1 - c) =
+                        (sibling & FLAGS_MASK) | new_ptr;
+                    if (CHILD_IS_CELL(sibling))
+                        cell_set_parent(cell_sub(sub, new_ptr), sub);
+                    cell_free_node(cell, n);
+                    cell_free_ptr(cell, sibling & INDEX_MASK);
+                    cell_dec_ncount(cell, 1);
+#ifdef C3BT_STATS
+                    __atomic_fetch_add(&c3bt_stat_pushdowns, 1,
+                        __ATOMIC_RELAXED);
+#endif
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+/* Add for a writer, which is NULL unless the tree has concurrent readers. */
+static bool tree_add(c3bt_tree_impl *tree, void *uobj, rcu_writer *w)
+{
+    c3bt_cursor_impl cur;
+    c3bt_cell *root;
+    str_key skey, *sk;
+    void *robj, *key;
+    uint64_t removed;
+    int cbit_nr, bit, new_node, new_ptr, lower;
+
+#ifdef C3BT_COMPRESSED
+    if (!uobj_fits(tree, uobj))
+        return false;
+#endif
+    /* The key's str_key lasts across restarts: the key doesn't change. */
+    key = (char*)uobj + tree->key_offset;
+    sk = key_sk(tree, key, &skey);
+    rcu_enter(tree, w);
+
+    restart:
+
+    removed = rcu_removes_done(tree, w);
+    root = tree_root(tree);
+    /* Empty -> singleton. */
+    if (!root) {
+        if (!rcu_hold_empty(tree, w))
+            goto fail;
+        cur.cell = cell_new(tree, w);
+        if (!cur.cell)
+            goto fail;
+        NODE_CHILD(cur.cell, 0, 0) = CHILD_UOBJ_BIT | 0;
+        NODE_CHILD(cur.cell, 0, 1) = CHILD_CELL_BIT | 1;
+        cur.cell->P[0] = uobj_to_ref(tree, uobj);
+        cell_take_node(cur.cell, 0);
+        cell_take_ptr(cur.cell, 0);
+        tree_set_root(tree, cur.cell);
+        /* Redundant for a new cell:
+         * cur.cell->P[1] = NULL;
+         * cur.cell->pnc = cell_make_pnc(NULL, 1);
+         */
+#ifdef C3BT_STATS
+        __atomic_store_n(&c3bt_stat_cells, 1, __ATOMIC_RELAXED);
+#endif
+        goto done;
+    }
+    robj = tree_lookup(tree, root, key, sk, &cur);
+    cbit_nr = key_crit(tree, key, sk, (char*)robj + tree->key_offset, NULL);
+    if (cbit_nr == -1)
+        goto fail;
+    bit = key_bit(tree, sk, key, cbit_nr);
+    /* Add to singleton. */
+    if (cell_is_singleton(root)) {
+        cur.cell = cell_cow(tree, w, root);
+        if (!cur.cell)
+            goto fail;
+        cur.cell->P[1] = uobj_to_ref(tree, uobj);
+        cell_take_ptr(cur.cell, 1);
+        NODE_CBIT(cur.cell, 0) = cbit_nr;
+        NODE_CHILD(cur.cell, 0, bit) = CHILD_UOBJ_BIT | 1;
+        NODE_CHILD(cur.cell, 0, 1 - bit) = CHILD_UOBJ_BIT | 0;
+        goto done;
+    }
+    /* Find insertion point. */
+    if (cbit_nr > NODE_CBIT(cur.cell, cur.nid)) {
+        /* No need to search from root. */
+        lower = NODE_CHILD(cur.cell, cur.nid, cur.cid);
+    } else {
+        /* Find location for new node.  We need to start from tree root because
+         * it must follow the correct path.  Since we may insert a node with
+         * large cbit number in a high cell, upwards cell-by-cell searching
+         * won't work.
+         */
+        cur.cell = root;
+
+        next:
+
+        cur.nid = INVALID_NODE;
+        lower = 0;
+        while (!CHILD_IS_UOBJ(lower)) {
+            if (NODE_CBIT(cur.cell, lower) > cbit_nr)
+                break;
+            cur.nid = lower;
+            cur.cid = key_bit(tree, sk, key, NODE_CBIT(cur.cell, lower));
+            lower = NODE_CHILD(cur.cell, lower, cur.cid);
+            if (CHILD_IS_CELL(lower)) {
+                cur.cell = cell_sub(cur.cell, lower & INDEX_MASK);
+                goto next;
+            }
+        }
+    }
+    /* The changes go to a private copy in a concurrent tree. */
+    cur.cell = cell_cow(tree, w, cur.cell);
+    if (!cur.cell)
+        goto fail;
+    /* Make room for a full cell.  Re-searching the cell afterwards is necessary
+     * because we don't know if the insertion point has been moved out.
+     */
+    if (cell_ncount(cur.cell) == NODES_PER_CELL) {
+        /* Try to push down a node first; it's cheaper. */
+        if (cell_push_down(tree, w, cur.cell))
+            goto next;
+        /* Then we have to split. */
+        if (!cell_split(tree, w, cur.cell))
+            goto fail;
+#ifdef C3BT_STATS
+        __atomic_fetch_add(&c3bt_stat_cells, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&c3bt_stat_splits, 1, __ATOMIC_RELAXED);
+#endif
+        goto next;
+    }
+    /* The insertion point holds only if no key went away meanwhile. */
+    if (!rcu_removes_quiet(tree, w, removed)) {
+        rcu_abort(tree, w);
+        rcu_removes_wait(tree, w);
+        goto restart;
+    }
+    new_node = cell_alloc_node(cur.cell);
+    new_ptr = cell_alloc_ptr(cur.cell);
+    cell_inc_ncount(cur.cell, 1);
+    cur.cell->P[new_ptr] = uobj_to_ref(tree, uobj);
+    if (cur.nid == INVALID_NODE) {
+        /* Insert as cell root. */
+        cell_copy_node(cur.cell, new_node, cur.cell, 0);
+        lower = new_node;
+        new_node = 0;
+    }
+    /* Insert between cur.nid and lower. */
+    NODE_CBIT(cur.cell, new_node) = cbit_nr;
+    if (cur.nid != INVALID_NODE)
+        NODE_CHILD(cur.cell, cur.nid, cur.cid) = new_node;
+    NODE_CHILD(cur.cell, new_node, bit) = new_ptr | CHILD_UOBJ_BIT;
+    NODE_CHILD(cur.cell, new_node, 1 - bit) = lower;
+
+    done:
+
+    rcu_commit(tree, w);
+    rcu_exit(tree, w);
+#ifdef C3BT_WITH_THREADS
+    __atomic_add_fetch(&tree->n_objects, 1, __ATOMIC_RELAXED);
+#else
+    tree->n_objects++;
+#endif
+    return true;
+
+    fail:
+
+    rcu_abort(tree, w);
+    if (rcu_retry(tree, w))
+        goto restart;
+    rcu_exit(tree, w);
+    return false;
+}
+
+bool c3bt_add(c3bt_tree *c3bt, void *uobj)
+{
+    if (!c3bt || !uobj)
+        return false;
+    return tree_add((c3bt_tree_impl*)c3bt, uobj,
+        rcu_writer_of((c3bt_tree_impl*)c3bt, 0));
+}
+
+#ifdef C3BT_WITH_THREADS
+bool c3bt_add_mt(c3bt_tree *c3bt, void *uobj, int writer)
+{
+    c3bt_tree_impl *tree = (c3bt_tree_impl*)c3bt;
+
+    if (!tree || !uobj || !tree->rcu || writer < 0
+        || writer >= tree->rcu->nwriters)
+        return false;
+    return tree_add(tree, uobj, tree->rcu->writers[writer]);
+}
+#endif
+
+/*
+ * A part of the tree being bulk built: either a single exit (an uobj or a
+ * finished cell), or a connected group of up to NODES_PER_CELL nodes not yet
+ * placed in a cell.  The group is kept in a scratch cell with its root at node
+ * 0, so placing it is a copy.
+ */
+typedef struct bulk_part {
+    c3bt_cell cell; /* the node group, if n > 0. */
+    c3bt_ref ref; /* the exit, if n == 0. */
+    int cbit; /* crit-bit of the pending node, while on the build stack. */
+    uint16_t n; /* number of nodes in the group. */
+    uint16_t exit; /* CHILD_UOBJ_BIT or CHILD_CELL_BIT, if n == 0. */
+} bulk_part;
+
+/*
+ * Place the node group of a part in a new cell, turning it into an exit.
+ * Return the cell, or NULL if no memory.
+ */
+static c3bt_cell *bulk_close(c3bt_tree_impl *tree, bulk_part *part)
+{
+    c3bt_cell *cell;
+    int n, c, x;
+
+    cell = cell_malloc(tree);
+    if (!cell)
+        return NULL;
+    memcpy(cell, &part->cell, sizeof(c3bt_cell));
+    cell->pnc = cell_make_pnc(NULL, part->n);
+    for (n = 0; n < part->n; n++)
+        for (c = 0; c < 2; c++) {
+            x = NODE_CHILD(cell, n, c);
+            if (CHILD_IS_CELL(x))
+                cell_set_parent(cell_sub(cell, x & INDEX_MASK), cell);
+        }
+#ifdef C3BT_STATS
+    /* Also called by the threads of c3bt_build(). */
+    __atomic_fetch_add(&c3bt_stat_cells, 1, __ATOMIC_RELAXED);
+#endif
+    part->ref = cell_to_ref(cell);
+    part->exit = CHILD_CELL_BIT;
+    part->n = 0;
+    return cell;
+}
+
+/*
+ * Copy the subtree at node nid of part into the group of dst; return the child
+ * value which links it.
+ */
+static int bulk_graft(c3bt_cell *dst, int *count, bulk_part *part, int nid)
+{
+    int dnid, pid, c, x;
+
+    if (part->n == 0) {
+        pid = cell_alloc_ptr(dst);
+        dst->P[pid] = part->ref;
+        return part->exit | pid;
+    }
+    dnid = (*count)++;
+    cell_take_node(dst, dnid);
+    NODE_CBIT(dst, dnid) = NODE_CBIT(&part->cell, nid);
+    for (c = 0; c < 2; c++) {
+        x = NODE_CHILD(&part->cell, nid, c);
+        if (CHILD_IS_NODE(x))
+            x = bulk_graft(dst, count, part, x);
+        else {
+            pid = cell_alloc_ptr(dst);
+            dst->P[pid] = part->cell.P[x & INDEX_MASK];
+            x = (x & FLAGS_MASK) | pid;
+        }
+        NODE_CHILD(dst, dnid, c) = x;
+    }
+    return dnid;
+}
+
+/*
+ * Join two parts under a new node.  If the groups don't fit in one cell
+ * together, the bigger one is placed in a cell of its own first.  Closing
+ * groups bottom-up only when they must be closed minimizes the number of
+ * cells, and fills them as much as the shape of the tree allows.
+ */
+static bool bulk_join(c3bt_tree_impl *tree, bulk_part *dst, int cbit,
+    bulk_part *left, bulk_part *right)
+{
+    bulk_part *big;
+    int count;
+
+    while (1 + left->n + right->n > NODES_PER_CELL) {
+        big = left->n > right->n ? left : right;
+        if (!bulk_close(tree, big))
+            return false;
+    }
+    cell_clear(&dst->cell);
+    count = 1;
+    cell_take_node(&dst->cell, 0);
+    NODE_CBIT(&dst->cell, 0) = cbit;
+    NODE_CHILD(&dst->cell, 0, 0) = bulk_graft(&dst->cell, &count, left, 0);
+    NODE_CHILD(&dst->cell, 0, 1) = bulk_graft(&dst->cell, &count, right, 0);
+    dst->n = count;
+    return true;
+}
+
+/*
+ * Build the crit-bit tree of sorted uobjs into out, leaving its top node group
+ * open.  The leaves are uobjs[0, n) themselves if parts is NULL; otherwise
+ * they are parts[0, n), each the finished subtree of uobjs[starts[i],
+ * starts[i + 1]).  stack must have room for key_nbits entries.
+ *
+ * The crit-bit tree of sorted keys is the Cartesian tree of the crit-bits
+ * between adjacent leaves, the smallest on top.  The stack holds its right
+ * spine, each entry with its finished left part; crit-bits increase strictly
+ * towards the top, so key_nbits entries are enough.
+ */
+static bool bulk_build(c3bt_tree_impl *tree, void **uobjs, size_t *starts,
+    bulk_part *parts, size_t n, bulk_part *stack, bulk_part *out)
+{
+    bulk_part cur, tmp;
+    str_key skeys[2], *sk, *psk = NULL;
+    size_t i, k, sp;
+    int cbit;
+
+    sp = 0;
+    for (i = 0; i <= n; i++) {
+        cbit = -1;
+        if (i > 0 && i < n) {
+            /* The first differing bit must be set in the greater key.  Of
+             * adjacent leaves, the str_key of the lesser key is the last one.
+             */
+            k = parts ? starts[i] : i;
+            sk = key_sk(tree, (char*)uobjs[k] + tree->key_offset,
+                skeys + i % 2);
+            cbit = key_crit(tree, (char*)uobjs[k - 1] + tree->key_offset,
+                parts ? NULL : psk, (char*)uobjs[k] + tree->key_offset, sk);
+            if (cbit < 0 || cbit >= (int)tree->key_nbits || !key_bit(tree, sk,
+                (char*)uobjs[k] + tree->key_offset, cbit))
+                return false;
+            psk = sk;
+        }
+        /* cur is the right part of every entry with a greater crit-bit. */
+        while (sp && stack[sp - 1].cbit > cbit) {
+            sp--;
+            if (!bulk_join(tree, &tmp, stack[sp].cbit, &stack[sp], &cur))
+                return false;
+            cur = tmp;
+        }
+        if (i == n)
+            break;
+        if (i > 0) {
+            stack[sp] = cur;
+            stack[sp++].cbit = cbit;
+        }
+        if (parts) {
+            cur = parts[i];
+            continue;
+        }
+        if (!uobjs[i])
+            return false;
+#ifdef C3BT_COMPRESSED
+        if (!uobj_fits(tree, uobjs[i]))
+            return false;
+#endif
+        cur.n = 0;
+        cur.exit = CHILD_UOBJ_BIT;
+        cur.ref = uobj_to_ref(tree, uobjs[i]);
+    }
+    *out = cur;
+    return true;
+}
+
+/* Install the built tree, or release all cells if building failed. */
+static bool bulk_finish(c3bt_tree_impl *tree, bool ok, bulk_part *top,
+    size_t n)
+{
+    c3bt_cell *root = NULL;
+
+    if (ok)
+        root = bulk_close(tree, top);
+    if (!root) {
+        cell_free_all(tree);
+        rcu_forget(tree);
+        return false;
+    }
+    tree_set_root(tree, root);
+    tree->n_objects = n;
+    return true;
+}
+
+bool c3bt_build_sorted(c3bt_tree *c3bt, void **uobjs, size_t n)
+{
+    c3bt_tree_impl *tree;
+    bulk_part *stack, top;
+    bool ok;
+
+    if (!c3bt || (n && !uobjs))
+        return false;
+    tree = (c3bt_tree_impl*)c3bt;
+    if (tree->root)
+        return false;
+    if (n <= 1)
+        return n == 0 || c3bt_add(c3bt, uobjs[0]);
+    stack = malloc(tree->key_nbits * sizeof(bulk_part));
+    if (!stack)
+        return false;
+    ok = bulk_build(tree, uobjs, NULL, NULL, n, stack, &top);
+    free(stack);
+    return bulk_finish(tree, ok, &top, n);
+}
+
+#ifdef C3BT_WITH_THREADS
+/*
+ * Parallel build.  Unsorted input is sorted by a sample sort: splitters are
+ * picked from a sorted sample, every thread distributes a chunk of the input
+ * into buckets, then sorts one bucket.  The sorted array is cut into ranges
+ * which are complete subtrees, found by splitting at the top crit-bits, and
+ * threads build them with their own cell allocation.  Finally the ranges are
+ * joined as leaves by the same algorithm.
+ */
+#define BULK_SAMPLES        64 /* per thread. */
+#define BULK_RANGES         8 /* per thread. */
+#define BULK_MIN_CHUNK      4096 /* uobjs per thread, at least. */
+
+typedef struct bulk_ctx {
+    c3bt_tree_impl *tree;
+    void **uobjs;
+    void **tmp;
+    size_t n;
+    int nthreads;
+    int failed;
+    void **splitters; /* nthreads - 1 of them. */
+    uint8_t *buckets; /* bucket of each uobj. */
+    size_t *counts; /* [thread][bucket], then start offsets. */
+    size_t *bucket_starts; /* nthreads + 1 of them. */
+    size_t *starts; /* start of each range, nranges + 1 of them. */
+    bulk_part *parts; /* the subtree of each range. */
+    size_t nranges;
+    size_t next_range;
+    c3bt_tree_impl *workers; /* cell allocation of each thread. */
+} bulk_ctx;
+
+typedef struct bulk_thread {
+    bulk_ctx *ctx;
+    void (*fn)(bulk_ctx *, int);
+    pthread_t tid;
+    int id;
+    int reserved;
+} bulk_thread;
+
+static int bulk_cmp(c3bt_tree_impl *tree, void *a, void *b)
+{
+    str_key skey, *sk;
+    int cbit;
+
+    a = (char*)a + tree->key_offset;
+    b = (char*)b + tree->key_offset;
+    sk = key_sk(tree, a, &skey);
+    cbit = key_crit(tree, a, sk, b, NULL);
+    if (cbit < 0 || cbit >= (int)tree->key_nbits)
+        return 0;
+    return key_bit(tree, sk, a, cbit) ? 1 : -1;
+}
+
+/* Sort a[0, n) with merge sort; the result is in b if to_b, else in a. */
+static void bulk_sort(c3bt_tree_impl *tree, void **a, void **b, size_t n,
+    bool to_b)
+{
+    void **src, **dst;
+    size_t m, i, j, k;
+
+    if (n < 2) {
+        if (to_b && n)
+            b[0] = a[0];
+        return;
+    }
+    m = n / 2;
+    bulk_sort(tree, a, b, m, !to_b);
+    bulk_sort(tree, a + m, b + m, n - m, !to_b);
+    src = to_b ? a : b;
+    dst = to_b ? b : a;
+    for (i = 0, j = m, k = 0; i < m && j < n; k++)
+        dst[k] = bulk_cmp(tree, src[j], src[i]) < 0 ? src[j++] : src[i++];
+    while (i < m)
+        dst[k++] = src[i++];
+    while (j < n)
+        dst[k++] = src[j++];
+}
+
+/* The bucket of an uobj: the number of splitters not greater than it. */
+static int bulk_bucket(bulk_ctx *ctx, void *uobj)
+{
+    int lo = 0, hi = ctx->nthreads - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (bulk_cmp(ctx->tree, uobj, ctx->splitters[mid]) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+static void bulk_chunk(bulk_ctx *ctx, int id, size_t *lo, size_t *hi)
+{
+    *lo = ctx->n * id / ctx->nthreads;
+    *hi = ctx->n * (id + 1) / ctx->nthreads;
+}
+
+static void bulk_classify(bulk_ctx *ctx, int id)
+{
+    size_t *counts = ctx->counts + (size_t)id * ctx->nthreads;
+    size_t i, lo, hi;
+
+    bulk_chunk(ctx, id, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        ctx->buckets[i] = bulk_bucket(ctx, ctx->uobjs[i]);
+        counts[ctx->buckets[i]]++;
+    }
+}
+
+static void bulk_scatter(bulk_ctx *ctx, int id)
+{
+    size_t *offsets = ctx->counts + (size_t)id * ctx->nthreads;
+    size_t i, lo, hi;
+
+    bulk_chunk(ctx, id, &lo, &hi);
+    for (i = lo; i < hi; i++)
+        ctx->tmp[offsets[ctx->buckets[i]]++] = ctx->uobjs[i];
+}
+
+static void bulk_sort_bucket(bulk_ctx *ctx, int id)
+{
+    size_t lo = ctx->bucket_starts[id], hi = ctx->bucket_starts[id + 1];
+
+    bulk_sort(ctx->tree, ctx->tmp + lo, ctx->uobjs + lo, hi - lo, true);
+}
+
+/*
+ * Split sorted uobjs[lo, hi) at its top crit-bit: [lo, mid) have the bit
+ * cleared and [mid, hi) have it set.  Return false if the keys are all equal.
+ */
+static bool bulk_split(c3bt_tree_impl *tree, void **uobjs, size_t lo,
+    size_t hi, size_t *mid)
+{
+    int cbit;
+
+    cbit = tree->bitops(-(tree->key_nbits + 1),
+        (char*)uobjs[lo] + tree->key_offset,
+        (char*)uobjs[hi - 1] + tree->key_offset);
+    if (cbit < 0 || cbit >= (int)tree->key_nbits)
+        return false;
+    lo++;
+    hi--;
+    while (lo < hi) {
+        *mid = lo + (hi - lo) / 2;
+        if (tree->bitops(cbit, (char*)uobjs[*mid] + tree->key_offset, NULL))
+            hi = *mid;
+        else
+            lo = *mid + 1;
+    }
+    *mid = lo;
+    return true;
+}
+
+/* Cut the sorted input into complete subtrees of at most max uobjs. */
+static bool bulk_plan(bulk_ctx *ctx, size_t max)
+{
+    size_t *ranges, *tmp, nranges, size, lo, hi, mid;
+
+    ctx->starts = malloc(sizeof(size_t));
+    if (!ctx->starts)
+        return false;
+    ctx->nranges = 0;
+    /* Pending ranges, the leftmost on top. */
+    size = 64;
+    ranges = malloc(size * 2 * sizeof(size_t));
+    if (!ranges)
+        return false;
+    ranges[0] = 0;
+    ranges[1] = ctx->n;
+    nranges = 1;
+    while (nranges) {
+        nranges--;
+        lo = ranges[nranges * 2];
+        hi = ranges[nranges * 2 + 1];
+        if (hi - lo <= max) {
+            tmp = realloc(ctx->starts, (ctx->nranges + 2) * sizeof(size_t));
+            if (!tmp)
+                goto fail;
+            ctx->starts = tmp;
+            ctx->starts[ctx->nranges++] = lo;
+            ctx->starts[ctx->nranges] = hi;
+            continue;
+        }
+        if (!bulk_split(ctx->tree, ctx->uobjs, lo, hi, &mid))
+            goto fail;
+        if (nranges + 2 > size) {
+            size *= 2;
+            tmp = realloc(ranges, size * 2 * sizeof(size_t));
+            if (!tmp)
+                goto fail;
+            ranges = tmp;
+        }
+        ranges[nranges * 2] = mid;
+        ranges[nranges * 2 + 1] = hi;
+        ranges[nranges * 2 + 2] = lo;
+        ranges[nranges * 2 + 3] = mid;
+        nranges += 2;
+    }
+    free(ranges);
+    return true;
+
+fail:
+    free(ranges);
+    return false;
+}
+
+static void bulk_build_ranges(bulk_ctx *ctx, int id)
+{
+    c3bt_tree_impl *tree = ctx->workers + id;
+    bulk_part *stack;
+    size_t r, lo, hi;
+
+    stack = malloc(tree->key_nbits * sizeof(bulk_part));
+    if (!stack) {
+        __atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    while (!__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED)) {
+        r = __atomic_fetch_add(&ctx->next_range, 1, __ATOMIC_RELAXED);
+        if (r >= ctx->nranges)
+            break;
+        lo = ctx->starts[r];
+        hi = ctx->starts[r + 1];
+#ifdef C3BT_COMPRESSED
+        /* Each range has its own slice of the arena; see c3bt_build(). */
+        tree->arena_top = ctx->parts[r].ref;
+#endif
+        if (!bulk_build(tree, ctx->uobjs + lo, NULL, NULL, hi - lo, stack,
+            ctx->parts + r))
+            __atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+    }
+    free(stack);
+}
+
+static void *bulk_thread_main(void *arg)
+{
+    bulk_thread *t = arg;
+
+    t->fn(t->ctx, t->id);
+    return NULL;
+}
+
+/* Run fn on all threads; the calling thread is thread 0. */
+static bool bulk_run(bulk_ctx *ctx, bulk_thread *threads,
+    void (*fn)(bulk_ctx *, int))
+{
+    int i, n;
+
+    for (n = 1; n < ctx->nthreads; n++) {
+        threads[n].ctx = ctx;
+        threads[n].fn = fn;
+        threads[n].id = n;
+        if (pthread_create(&threads[n].tid, NULL, bulk_thread_main,
+            threads + n))
+            break;
+    }
+    /* If a thread couldn't start, this one does its share. */
+    for (i = n; i < ctx->nthreads; i++)
+        fn(ctx, i);
+    fn(ctx, 0);
+    for (i = 1; i < n; i++)
+        pthread_join(threads[i].tid, NULL);
+    return !ctx->failed;
+}
+
+/* Sort uobjs in place with a sample sort. */
+static bool bulk_sample_sort(bulk_ctx *ctx, bulk_thread *threads)
+{
+    size_t i, j, sum, ns, T = ctx->nthreads;
+    void **sample;
+
+    ns = T * BULK_SAMPLES;
+    sample = malloc(ns * 2 * sizeof(void*));
+    if (!sample)
+        return false;
+    for (i = 0; i < ns; i++)
+        sample[i] = ctx->uobjs[ctx->n / ns * i];
+    bulk_sort(ctx->tree, sample, sample + ns, ns, false);
+    ctx->splitters = sample + ns;
+    for (i = 1; i < T; i++)
+        ctx->splitters[i - 1] = sample[ns * i / T];
+
+    bulk_run(ctx, threads, bulk_classify);
+    /* Counts become output offsets: bucket-major, then thread. */
+    sum = 0;
+    for (j = 0; j < T; j++) {
+        ctx->bucket_starts[j] = sum;
+        for (i = 0; i < T; i++) {
+            ns = ctx->counts[i * T + j];
+            ctx->counts[i * T + j] = sum;
+            sum += ns;
+        }
+    }
+    ctx->bucket_starts[T] = sum;
+    bulk_run(ctx, threads, bulk_scatter);
+    bulk_run(ctx, threads, bulk_sort_bucket);
+    free(sample);
+    return true;
+}
+
+bool c3bt_build(c3bt_tree *c3bt, void **uobjs, size_t n, int nthreads)
+{
+    c3bt_tree_impl *tree;
+    bulk_ctx ctx;
+    bulk_thread *threads = NULL;
+    bulk_part *stack = NULL, top;
+    bool ok = false;
+    int i;
+#ifdef C3BT_COMPRESSED
+    size_t r, slice, base;
+#endif
+
+    if (!c3bt || (n && !uobjs))
+        return false;
+    tree = (c3bt_tree_impl*)c3bt;
+    if (tree->root)
+        return false;
+    if (n <= 1)
+        return n == 0 || c3bt_add(c3bt, uobjs[0]);
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > 256)
+        nthreads = 256;
+    if ((size_t)nthreads > n / BULK_MIN_CHUNK)
+        nthreads = n / BULK_MIN_CHUNK;
+    if (nthreads <= 1) {
+        /* Not worth the threads. */
+        ctx.tmp = malloc(n * sizeof(void*));
+        if (!ctx.tmp)
+            return false;
+        bulk_sort(tree, uobjs, ctx.tmp, n, false);
+        free(ctx.tmp);
+        return c3bt_build_sorted(c3bt, uobjs, n);
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.tree = tree;
+    ctx.uobjs = uobjs;
+    ctx.n = n;
+    ctx.nthreads = nthreads;
+    threads = calloc(nthreads, sizeof(bulk_thread));
+    ctx.tmp = malloc(n * sizeof(void*));
+    ctx.buckets = malloc(n);
+    ctx.counts = calloc((size_t)nthreads * nthreads, sizeof(size_t));
+    ctx.bucket_starts = malloc((nthreads + 1) * sizeof(size_t));
+    ctx.workers = calloc(nthreads, sizeof(c3bt_tree_impl));
+    stack = malloc(tree->key_nbits * sizeof(bulk_part));
+    if (!threads || !ctx.tmp || !ctx.buckets || !ctx.counts
+        || !ctx.bucket_starts || !ctx.workers || !stack)
+        goto done;
+    if (!bulk_sample_sort(&ctx, threads))
+        goto done;
+    free(ctx.tmp);
+    ctx.tmp = NULL;
+    if (!bulk_plan(&ctx, (n + nthreads * BULK_RANGES - 1)
+        / (nthreads * BULK_RANGES)))
+        goto done;
+    ctx.parts = malloc(ctx.nranges * sizeof(bulk_part));
+    if (!ctx.parts)
+        goto done;
+
+#ifdef C3BT_COMPRESSED
+    /* Threads share the tree's arena, each range in its own slice.  Cells
+     * closed by bulk_join() hold at least half a cell of nodes, which bounds
+     * the size of a slice.  The unused tails are never touched.
+     */
+    if (!uobj_fits(tree, uobjs[0]))
+        goto done;
+    if (!tree->arena) {
+        tree->arena = arena_create();
+        if (!tree->arena)
+            goto done;
+        tree->arena_top = 1;
+    }
+    base = tree->arena_top;
+    for (r = 0; r < ctx.nranges; r++) {
+        slice = (ctx.starts[r + 1] - ctx.starts[r] - 1)
+            / ((NODES_PER_CELL + 1) / 2) + 1;
+        ctx.parts[r].ref = base;
+        base += slice;
+    }
+    if (base >= ARENA_CELLS)
+        goto done;
+    tree->arena_top = base;
+#endif
+    for (i = 0; i < nthreads; i++)
+        ctx.workers[i] = *tree;
+#ifdef C3BT_COMPRESSED
+    for (i = 0; i < nthreads; i++)
+        ctx.workers[i].arena_free = 0;
+#else
+    for (i = 0; i < nthreads; i++) {
+        ctx.workers[i].slab = NULL;
+        ctx.workers[i].slab_free = NULL;
+        ctx.workers[i].slab_top = 0;
+        ctx.workers[i].slab_size = 0;
+    }
+#endif
+    ok = bulk_run(&ctx, threads, bulk_build_ranges);
+#ifndef C3BT_COMPRESSED
+    /* Hand the slabs of the threads over to the tree. */
+    for (i = 0; i < nthreads; i++)
+        slab_adopt(tree, ctx.workers + i);
+#endif
+    if (ok)
+        ok = bulk_build(tree, uobjs, ctx.starts, ctx.parts, ctx.nranges,
+            stack, &top);
+    ok = bulk_finish(tree, ok, &top, n);
+
+done:
+    free(threads);
+    free(ctx.tmp);
+    free(ctx.buckets);
+    free(ctx.counts);
+    free(ctx.bucket_starts);
+    free(ctx.workers);
+    free(ctx.starts);
+    free(ctx.parts);
+    free(stack);
+    return ok;
+}
+#endif
+
+/*
+ * Find the anchor point (return as nid<<1|cid) in parent cell.
+ * Note: cell must not be the root cell.
+ */
+static int cell_find_anchor(c3bt_cell *cell, c3bt_cell *parent)
+{
+    int i;
+#ifndef C3BT_SOA
+    uint nid, cid;
+#endif
+    c3bt_ref ref = cell_to_ref(cell);
+
+    for (i = 0; parent->P[i] != ref; i++)
+        /* nothing */;
+    i |= CHILD_CELL_BIT;
+#ifdef C3BT_SOA
+    return cell_child_locate(__builtin_ctz(cell_child_match(parent, 0xFF, i)));
+#else
+    for (nid = 0; nid < NODES_PER_CELL; nid++) {
+        if (cell_node_is_vacant(parent, nid))
+            continue;
+        for (cid = 0; cid < 2; cid++)
+            if (NODE_CHILD(parent, nid, cid) == i)
+                goto found;
+    }
+
+    found:
+
+    return nid << 1 | cid;
+#endif
+}
+
+/*
+ * Merge a cell into its parent cell.
+ *
+ * Iterative post-order traversal using two stacks.  Sizes of the stacks are
+ * fixed and are set for largest possible cell (with NODES_PER_CELL-1 nodes).
+ * This function uses about 92B stack on x86 and 64B on ARM (LP32), which is
+ * less than 1/3 of the recursive equivalent under worst condition.
+ */
+static void cell_merge(c3bt_tree_impl *tree, rcu_writer *w, c3bt_cell *cell,
+    c3bt_cell *parent, int anchor)
+{
+    int wtop, ftop, n, c, new_node, new_ptr;
+    uint8_t wstack[NODES_PER_CELL];
+    uint8_t fstack[NODES_PER_CELL * 2 - 1];
+
+    cell_free_ptr(parent,
+        NODE_CHILD(parent, anchor >> 1, anchor & 1) & INDEX_MASK);
+    /* Use wstack to make a full post-order stack in fstack. */
+    ftop = -1;
+    wtop = 0;
+    wstack[0] = 0;
+    while (wtop >= 0) {
+        n = wstack[wtop--];
+        fstack[++ftop] = n;
+        if (CHILD_IS_NODE(n))
+            for (c = 0; c < 2; c++)
+                wstack[++wtop] = NODE_CHILD(cell, n, c);
+    }
+    /* Copy everything in full stack. */
+    while (ftop >= 0) {
+        n = fstack[ftop];
+        if (CHILD_IS_NODE(n)) {
+            /* Copy a node with its children, and replace with its new index in
+             * parent cell.
+             */
+            new_node = cell_alloc_node(parent);
+            cell_inc_ncount(parent, 1);
+            NODE_CBIT(parent, new_node) = NODE_CBIT(cell, n);
+            wtop = ftop + 1;
+            for (c = 1; c >= 0; c--) {
+                while (fstack[wtop] == INVALID_NODE)
+                    wtop++;
+                NODE_CHILD(parent, new_node, c) = fstack[wtop];
+                fstack[wtop] = INVALID_NODE;
+            }
+            fstack[ftop] = new_node;
+        } else {
+            /* Copy a pointer and replace with its new index in parent cell. */
+            new_ptr = cell_alloc_ptr(parent);
+            c = n & INDEX_MASK;
+            parent->P[new_ptr] = cell->P[c];
+            if (CHILD_IS_CELL(n))
+                cell_set_parent(cell_sub(cell, c), parent);
+            fstack[ftop] = (n & FLAGS_MASK) | new_ptr;
+        }
+        ftop--;
+    }
+    NODE_CHILD(parent, anchor >> 1, anchor & 1) = fstack[0];
+    cell_drop(tree, w, cell);
+}
+
+/* Remove for a writer, which is NULL unless the tree has concurrent readers. */
+static bool tree_remove(c3bt_tree_impl *tree, void *uobj, rcu_writer *w)
+{
+    c3bt_cursor_impl loc;
+    c3bt_cell *parent, *sub;
+    uint8_t *pap;
+    int n, c, sibling, anchor;
+
+    rcu_enter(tree, w);
+
+    restart:
+
+    if (!c3bt_locate((c3bt_tree*)tree, uobj, (c3bt_cursor*)&loc)) {
+        rcu_exit(tree, w);
+        return false;
+    }
+    rcu_remove_begin(tree, w);
+    /* The changes go to private copies in a concurrent tree. */
+    loc.cell = cell_cow(tree, w, loc.cell);
+    if (!loc.cell)
+        goto fail;
+    parent = cell_parent(loc.cell);
+    cell_free_ptr(loc.cell,
+        NODE_CHILD(loc.cell, loc.nid, loc.cid) & INDEX_MASK);
+    if (!loc.nid) {
+        /* Remove from cell root. */
+        sibling = NODE_CHILD(loc.cell, 0, 1 - loc.cid);
+        if (CHILD_IS_NODE(sibling)) {
+            /* Sibling is a node: promote it to cell root. */
+            cell_copy_node(loc.cell, 0, loc.cell, sibling);
+            cell_free_node(loc.cell, sibling);
+        } else if (CHILD_IS_UOBJ(sibling) && !parent) {
+            /* Root cell has two uobjs: turn to singleton tree. */
+            NODE_CHILD(loc.cell, 0, 0) = CHILD_UOBJ_BIT | 0;
+            NODE_CHILD(loc.cell, 0, 1) = CHILD_CELL_BIT | 1;
+            n = sibling & INDEX_MASK;
+            loc.cell->P[0] = loc.cell->P[n];
+            if (n > 1)
+                cell_free_ptr(loc.cell, n);
+            cell_take_ptr(loc.cell, 0);
+            cell_free_ptr(loc.cell, 1);
+            goto done;
+        } else {
+            if (!parent) {
+                /* Root cell has a single node, one child being uobj pointer
+                 * (being removed) and another is a cell pointer.  This
+                 * condition also covers the singleton case.
+                 */
+                sub = cell_sub(loc.cell, sibling & INDEX_MASK);
+                if (sub)
+                    cell_set_parent(sub, NULL);
+                tree_set_root(tree, sub);
+            } else {
+                /* Non-root cell is becoming incomplete; push up then free. */
+                parent = cell_cow(tree, w, parent);
+                if (!parent)
+                    goto fail;
+                anchor = cell_find_anchor(loc.cell, parent);
+                pap = &NODE_CHILD(parent, anchor >> 1, anchor & 1);
+                *pap &= INDEX_MASK;
+                parent->P[*pap] = loc.cell->P[sibling & INDEX_MASK];
+                if (CHILD_IS_CELL(sibling))
+                    cell_set_parent(cell_sub(parent, *pap), parent);
+                *pap |= sibling & FLAGS_MASK;
+#ifdef C3BT_STATS
+                __atomic_fetch_add(&c3bt_stat_pushups, 1, __ATOMIC_RELAXED);
+#endif
+            }
+            cell_drop(tree, w, loc.cell);
+#ifdef C3BT_STATS
+            __atomic_fetch_sub(&c3bt_stat_cells, 1, __ATOMIC_RELAXED);
+#endif
+            goto done;
+        }
+    } else {
+        /* Not removing from cell root. */
+        n = cell_node_parent(loc.cell, loc.nid);
+        NODE_CHILD(loc.cell, n >> 1, n & 1) =
+            NODE_CHILD(loc.cell, loc.nid, 1 - loc.cid);
+        cell_free_node(loc.cell, loc.nid);
+    }
+    cell_dec_ncount(loc.cell, 1);
+
+    /* Try merging up to parent; if it can't be copied now, don't. */
+    if (parent && cell_ncount(loc.cell) + cell_ncount(parent) <= NODES_PER_CELL
+        && (parent = cell_cow(tree, w, parent))) {
+        anchor = cell_find_anchor(loc.cell, parent);
+        cell_merge(tree, w, loc.cell, parent, anchor);
+        goto merge_done;
+    }
+    /* Try merging up a sub-cell. */
+    for (n = 0; n < NODES_PER_CELL; n++) {
+        if (cell_node_is_vacant(loc.cell, n))
+            continue;
+        for (c = 0; c < 2; c++) {
+            if (CHILD_IS_CELL(NODE_CHILD(loc.cell, n, c))) {
+                sub = cell_sub(loc.cell,
+                    NODE_CHILD(loc.cell, n, c) & INDEX_MASK);
+                if (cell_ncount(loc.cell) + cell_ncount(sub) <= NODES_PER_CELL
+                    && rcu_hold(tree, w, sub)) {
+                    cell_merge(tree, w, sub, loc.cell, n << 1 | c);
+                    goto merge_done;
+                }
+            }
+        }
+    }
+    goto done;
+
+    merge_done:
+
+#ifdef C3BT_STATS
+    __atomic_fetch_add(&c3bt_stat_merges, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&c3bt_stat_cells, 1, __ATOMIC_RELAXED);
+#endif
+
+    done:
+
+    rcu_commit(tree, w);
+    rcu_remove_end(tree, w);
+    rcu_exit(tree, w);
+#ifdef C3BT_WITH_THREADS
+    __atomic_sub_fetch(&tree->n_objects, 1, __ATOMIC_RELAXED);
+#else
+    tree->n_objects--;
+#endif
+    return true;
+
+    fail:
+
+    rcu_abort(tree, w);
+    rcu_remove_end(tree, w);
+    if (rcu_retry(tree, w))
+        goto restart;
+    rcu_exit(tree, w);
+    return false;
+}
+
+bool c3bt_remove(c3bt_tree *c3bt, void *uobj)
+{
+    if (!c3bt)
+        return false;
+    return tree_remove((c3bt_tree_impl*)c3bt, uobj,
+        rcu_writer_of((c3bt_tree_impl*)c3bt, 0));
+}
+
+#ifdef C3BT_WITH_THREADS
+bool c3bt_remove_mt(c3bt_tree *c3bt, void *uobj, int writer)
+{
+    c3bt_tree_impl *tree = (c3bt_tree_impl*)c3bt;
+
+    if (!tree || !tree->rcu || writer < 0 || writer >= tree->rcu->nwriters)
+        return false;
+    return tree_remove(tree, uobj, tree->rcu->writers[writer]);
+}
+#endif
+
+#ifdef C3BT_WITH_THREADS
+/*
+ * Sharded trees.  Each shard is a plain tree with a mutex and its counters,
+ * aligned to its own cache lines so that threads on different shards don't
+ * share any.  The shard of a key is its first nbits bits, by the bitops of the
+ * trees, so shards split the key space in key order.
+ */
+#ifdef C3BT_COMPRESSED
+#define SHARD_MAX_BITS      8 /* each reserves an arena of address space. */
+#else
+#define SHARD_MAX_BITS      16
+#endif
+
+typedef struct shard {
+    c3bt_tree tree;
+    pthread_mutex_t lock;
+    c3bt_shard_stats stats; /* but nobjects, which is the tree's. */
+} shard;
+
+struct c3bt_sharded {
+    shard **shards;
+    cpu_set_t cpus; /* CPUs to pin threads to, see c3bt_sharded_affinity(). */
+    int nbits;
+    int affinity;
+};
+
+typedef struct shard_ctx {
+    c3bt_sharded *sh;
+    void (*fn)(struct shard_ctx *, int);
+    void **uobjs; /* add_batch: the uobjs grouped by shard, */
+    size_t *starts; /* shard s at [starts[s], starts[s + 1]). */
+    size_t added;
+    void (*apply)(c3bt_tree *, int, void *);
+    void *arg;
+    int nthreads;
+    int reserved;
+} shard_ctx;
+
+typedef struct shard_thread {
+    shard_ctx *ctx;
+    pthread_t tid;
+    int id;
+    int reserved;
+} shard_thread;
+
+static inline c3bt_tree_impl *shard_tree(c3bt_sharded *sh, int s)
+{
+    return (c3bt_tree_impl*)&sh->shards[s]->tree;
+}
+
+static int shard_of(c3bt_sharded *sh, void *key)
+{
+    c3bt_tree_impl *tree = shard_tree(sh, 0);
+    int i, s = 0;
+
+    for (i = 0; i < sh->nbits; i++)
+        s = s << 1 | tree->bitops(i, key, NULL);
+    return s;
+}
+
+static shard *shard_lock(c3bt_sharded *sh, int s)
+{
+    shard *sd = sh->shards[s];
+
+    if (pthread_mutex_trylock(&sd->lock)) {
+        pthread_mutex_lock(&sd->lock);
+        sd->stats.waits++;
+    }
+    return sd;
+}
+
+c3bt_sharded *c3bt_sharded_new(uint kdt, uint koffset, uint kbits,
+    int shard_bits)
+{
+    c3bt_sharded *sh;
+    void *mem;
+    int s, n;
+
+    if (shard_bits < 0 || shard_bits > SHARD_MAX_BITS)
+        return NULL;
+    sh = calloc(1, sizeof(c3bt_sharded));
+    if (!sh)
+        return NULL;
+    sh->nbits = shard_bits;
+    n = 1 << shard_bits;
+    sh->shards = calloc(n, sizeof(shard*));
+    if (!sh->shards)
+        goto fail;
+    for (s = 0; s < n; s++) {
+        if (posix_memalign(&mem, 64, (sizeof(shard) + 63) & ~63))
+            goto fail;
+        sh->shards[s] = mem;
+        memset(mem, 0, sizeof(shard));
+        if (!c3bt_init(&sh->shards[s]->tree, kdt, koffset, kbits)
+            || (int)shard_tree(sh, s)->key_nbits < shard_bits) {
+            free(mem);
+            sh->shards[s] = NULL;
+            goto fail;
+        }
+        pthread_mutex_init(&sh->shards[s]->lock, NULL);
+    }
+    if (sched_getaffinity(0, sizeof(sh->cpus), &sh->cpus)
+        || CPU_COUNT(&sh->cpus) == 0) {
+        CPU_ZERO(&sh->cpus);
+        CPU_SET(0, &sh->cpus);
+    }
+    return sh;
+
+fail:
+    c3bt_sharded_free(sh);
+    return NULL;
+}
+
+void c3bt_sharded_free(c3bt_sharded *sh)
+{
+    int s;
+
+    if (!sh)
+        return;
+    for (s = 0; sh->shards && s < 1 << sh->nbits && sh->shards[s]; s++) {
+        c3bt_destroy(&sh->shards[s]->tree);
+        pthread_mutex_destroy(&sh->shards[s]->lock);
+        free(sh->shards[s]);
+    }
+    free(sh->shards);
+    free(sh);
+}
+
+int c3bt_sharded_nshards(c3bt_sharded *sh)
+{
+    return sh ? 1 << sh->nbits : 0;
+}
+
+int c3bt_sharded_shard_of(c3bt_sharded *sh, void *key)
+{
+    if (!sh || !key)
+        return -1;
+    return shard_of(sh, key);
+}
+
+c3bt_tree *c3bt_sharded_tree(c3bt_sharded *sh, int shard)
+{
+    if (!sh || shard < 0 || shard >= 1 << sh->nbits)
+        return NULL;
+    return &sh->shards[shard]->tree;
+}
+
+size_t c3bt_sharded_nobjects(c3bt_sharded *sh)
+{
+    size_t n = 0;
+    int s;
+
+    for (s = 0; sh && s < 1 << sh->nbits; s++)
+        n += __atomic_load_n(&shard_tree(sh, s)->n_objects, __ATOMIC_RELAXED);
+    return n;
+}
+
+bool c3bt_sharded_stats(c3bt_sharded *sh, int shard, c3bt_shard_stats *stats)
+{
+    if (!sh || shard < 0 || shard >= 1 << sh->nbits || !stats)
+        return false;
+    pthread_mutex_lock(&sh->shards[shard]->lock);
+    *stats = sh->shards[shard]->stats;
+    stats->nobjects = shard_tree(sh, shard)->n_objects;
+    pthread_mutex_unlock(&sh->shards[shard]->lock);
+    return true;
+}
+
+bool c3bt_sharded_add(c3bt_sharded *sh, void *uobj)
+{
+    shard *sd;
+    bool ok;
+
+    if (!sh || !uobj)
+        return false;
+    sd = shard_lock(sh, shard_of(sh,
+        (char*)uobj + shard_tree(sh, 0)->key_offset));
+    ok = c3bt_add(&sd->tree, uobj);
+    if (ok)
+        sd->stats.adds++;
+    pthread_mutex_unlock(&sd->lock);
+    return ok;
+}
+
+bool c3bt_sharded_remove(c3bt_sharded *sh, void *uobj)
+{
+    shard *sd;
+    bool ok;
+
+    if (!sh || !uobj)
+        return false;
+    sd = shard_lock(sh, shard_of(sh,
+        (char*)uobj + shard_tree(sh, 0)->key_offset));
+    ok = c3bt_remove(&sd->tree, uobj);
+    if (ok)
+        sd->stats.removes++;
+    pthread_mutex_unlock(&sd->lock);
+    return ok;
+}
+
+void *c3bt_sharded_find(c3bt_sharded *sh, void *key)
+{
+    c3bt_tree_impl *tree;
+    shard *sd;
+    void *robj;
+
+    if (!sh || !key)
+        return NULL;
+    sd = shard_lock(sh, shard_of(sh, key));
+    sd->stats.finds++;
+    tree = (c3bt_tree_impl*)&sd->tree;
+    robj = tree_lookup(tree, tree_root(tree), key, NULL, NULL);
+    if (robj && tree->bitops(-(tree->key_nbits + 1), key,
+        (char*)robj + tree->key_offset) != -1)
+        robj = NULL;
+    pthread_mutex_unlock(&sd->lock);
+    return robj;
+}
+
+/* Go on to the first (dir 1) or last (dir 0) uobj of the shards past s. */
+static void *shard_step(c3bt_sharded *sh, int s, c3bt_shard_cursor *cur,
+    int dir)
+{
+    void *robj = NULL;
+
+    while (!robj) {
+        s += dir ? 1 : -1;
+        if (s < 0 || s >= 1 << sh->nbits)
+            return NULL;
+        cur->shard = s;
+        robj = tree_extreme(shard_tree(sh, s), &cur->cur, !dir);
+    }
+    return robj;
+}
+
+void *c3bt_sharded_first(c3bt_sharded *sh, c3bt_shard_cursor *cur)
+{
+    if (!sh || !cur)
+        return NULL;
+    return shard_step(sh, -1, cur, 1);
+}
+
+void *c3bt_sharded_last(c3bt_sharded *sh, c3bt_shard_cursor *cur)
+{
+    if (!sh || !cur)
+        return NULL;
+    return shard_step(sh, 1 << sh->nbits, cur, 0);
+}
+
+void *c3bt_sharded_next(c3bt_sharded *sh, c3bt_shard_cursor *cur)
+{
+    void *robj;
+
+    if (!sh || !cur)
+        return NULL;
+    robj = c3bt_next(&sh->shards[cur->shard]->tree, &cur->cur);
+    return robj ? robj : shard_step(sh, cur->shard, cur, 1);
+}
+
+void *c3bt_sharded_prev(c3bt_sharded *sh, c3bt_shard_cursor *cur)
+{
+    void *robj;
+
+    if (!sh || !cur)
+        return NULL;
+    robj = c3bt_prev(&sh->shards[cur->shard]->tree, &cur->cur);
+    return robj ? robj : shard_step(sh, cur->shard, cur, 0);
+}
+
+/* Seek in the key's shard, then go on to the next ones in dir. */
+static void *shard_seek(c3bt_sharded *sh, void *key, c3bt_shard_cursor *cur,
+    int dir, bool inclusive)
+{
+    void *robj;
+    int s;
+
+    if (!sh || !key || !cur)
+        return NULL;
+    s = shard_of(sh, key);
+    cur->shard = s;
+    robj = tree_seek(shard_tree(sh, s), key, &cur->cur, dir, inclusive);
+    return robj ? robj : shard_step(sh, s, cur, dir);
+}
+
+void *c3bt_sharded_lower_bound(c3bt_sharded *sh, void *key,
+    c3bt_shard_cursor *cur)
+{
+    return shard_seek(sh, key, cur, 1, true);
+}
+
+void *c3bt_sharded_upper_bound(c3bt_sharded *sh, void *key,
+    c3bt_shard_cursor *cur)
+{
+    return shard_seek(sh, key, cur, 1, false);
+}
+
+void *c3bt_sharded_floor(c3bt_sharded *sh, void *key, c3bt_shard_cursor *cur)
+{
+    return shard_seek(sh, key, cur, 0, true);
+}
+
+/* Pin the calling thread to the n-th CPU of the set, modulo its size. */
+static bool shard_pin(cpu_set_t *cpus, int n)
+{
+    cpu_set_t set;
+    int cpu;
+
+    n %= CPU_COUNT(cpus);
+    for (cpu = 0; !CPU_ISSET(cpu, cpus) || n--; cpu++)
+        ;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+static int shard_nthreads(c3bt_sharded *sh, int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > 1 << sh->nbits)
+        nthreads = 1 << sh->nbits;
+    return nthreads > 1 ? nthreads : 1;
+}
+
+/* Thread id works on shards id, id + nthreads, ... */
+static void shard_work(shard_ctx *ctx, int id)
+{
+    int s;
+
+    for (s = id; s < 1 << ctx->sh->nbits; s += ctx->nthreads)
+        ctx->fn(ctx, s);
+}
+
+static void *shard_thread_main(void *arg)
+{
+    shard_thread *t = arg;
+
+    if (t->ctx->sh->affinity)
+        shard_pin(&t->ctx->sh->cpus, t->id);
+    shard_work(t->ctx, t->id);
+    return NULL;
+}
+
+/*
+ * Run fn on every shard.  The calling thread is thread 0, unless threads are
+ * pinned: then all are new ones, so that the caller stays as it is.
+ */
+static void shard_run(shard_ctx *ctx, void (*fn)(shard_ctx *, int))
+{
+    shard_thread *threads;
+    int i, n, first;
+
+    ctx->fn = fn;
+    first = ctx->sh->affinity ? 0 : 1;
+    threads = calloc(ctx->nthreads, sizeof(shard_thread));
+    for (n = first; threads && n < ctx->nthreads; n++) {
+        threads[n].ctx = ctx;
+        threads[n].id = n;
+        if (pthread_create(&threads[n].tid, NULL, shard_thread_main,
+            threads + n))
+            break;
+    }
+    if (!threads)
+        n = first;
+    /* If a thread couldn't start, this one does its share. */
+    for (i = n; i < ctx->nthreads; i++)
+        shard_work(ctx, i);
+    if (first)
+        shard_work(ctx, 0);
+    for (i = first; i < n; i++)
+        pthread_join(threads[i].tid, NULL);
+    free(threads);
+}
+
+/* Build an empty shard in one go; if that fails it's left empty. */
+static void shard_add_batch(shard_ctx *ctx, int s)
+{
+    void **uobjs = ctx->uobjs + ctx->starts[s];
+    size_t i, n = ctx->starts[s + 1] - ctx->starts[s], added = 0;
+    shard *sd;
+
+    if (!n)
+        return;
+    sd = shard_lock(ctx->sh, s);
+    if (!shard_tree(ctx->sh, s)->root && c3bt_build(&sd->tree, uobjs, n, 1))
+        added = n;
+    else
+        for (i = 0; i < n; i++)
+            added += c3bt_add(&sd->tree, uobjs[i]);
+    sd->stats.adds += added;
+    pthread_mutex_unlock(&sd->lock);
+    __atomic_add_fetch(&ctx->added, added, __ATOMIC_RELAXED);
+}
+
+size_t c3bt_sharded_add_batch(c3bt_sharded *sh, void **uobjs, size_t n,
+    int nthreads)
+{
+    shard_ctx ctx;
+    size_t i, *pos;
+    uint koffset;
+    int s, ns;
+
+    if (!sh || !uobjs || !n)
+        return 0;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.sh = sh;
+    ctx.nthreads = shard_nthreads(sh, nthreads);
+    ns = 1 << sh->nbits;
+    koffset = shard_tree(sh, 0)->key_offset;
+    ctx.uobjs = malloc(n * sizeof(void*));
+    ctx.starts = calloc(ns + 1, sizeof(size_t));
+    pos = malloc(ns * sizeof(size_t));
+    if (!ctx.uobjs || !ctx.starts || !pos)
+        goto done;
+    /* Group by shard, keeping the order within each. */
+    for (i = 0; i < n; i++)
+        ctx.starts[shard_of(sh, (char*)uobjs[i] + koffset) + 1]++;
+    for (s = 0; s < ns; s++) {
+        ctx.starts[s + 1] += ctx.starts[s];
+        pos[s] = ctx.starts[s];
+    }
+    for (i = 0; i < n; i++)
+        ctx.uobjs[pos[shard_of(sh, (char*)uobjs[i] + koffset)]++] = uobjs[i];
+    shard_run(&ctx, shard_add_batch);
+
+done:
+    free(ctx.uobjs);
+    free(ctx.starts);
+    free(pos);
+    return ctx.added;
+}
+
+static void shard_apply(shard_ctx *ctx, int s)
+{
+    shard *sd = shard_lock(ctx->sh, s);
+
+    ctx->apply(&sd->tree, s, ctx->arg);
+    pthread_mutex_unlock(&sd->lock);
+}
+
+void c3bt_sharded_apply(c3bt_sharded *sh,
+    void (*fn)(c3bt_tree *tree, int shard, void *arg), void *arg,
+    int nthreads)
+{
+    shard_ctx ctx;
+
+    if (!sh || !fn)
+        return;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.sh = sh;
+    ctx.nthreads = shard_nthreads(sh, nthreads);
+    ctx.apply = fn;
+    ctx.arg = arg;
+    shard_run(&ctx, shard_apply);
+}
+
+void c3bt_sharded_affinity(c3bt_sharded *sh, bool on)
+{
+    if (sh)
+        sh->affinity = on;
+}
+
+bool c3bt_sharded_pin(c3bt_sharded *sh, int shard, int nthreads)
+{
+    if (!sh || shard < 0 || shard >= 1 << sh->nbits)
+        return false;
+    return shard_pin(&sh->cpus, shard % shard_nthreads(sh, nthreads));
+}
+#endif
+
+#ifdef C3BT_WITH_THREADS
+/*
+ * Flat combining.  A thread posts its op in its own slot (a cache line each)
+ * and spins there; whoever gets the lock becomes the combiner, applies all the
+ * posted ops in key order and hands each result back in its slot.  The lock
+ * and the tree change hands once per batch instead of once per op.
+ */
+#define COMB_PASSES         4 /* scans for new ops per turn as combiner. */
+#define COMB_SPIN           64 /* spins before yielding the CPU. */
+#define COMB_ADD            1
+#define COMB_REMOVE         2
+
+typedef struct comb_slot {
+    void *uobj;
+    uint32_t op; /* posted op, back to 0 when done. */
+    uint32_t result;
+    uint8_t reserved[64 - sizeof(void*) - 8];
+} comb_slot;
+
+struct c3bt_combiner {
+    uint32_t lock; /* held by the combiner. */
+    uint32_t reserved[15]; /* the rest of the lock's line. */
+    c3bt_tree *tree;
+    comb_slot *slots;
+    comb_slot **batch; /* the ops of a pass, then in key order. */
+    int nslots;
+    int reserved2;
+};
+
+c3bt_combiner *c3bt_combiner_new(c3bt_tree *tree, int nslots)
+{
+    c3bt_combiner *fc;
+    void *mem;
+
+    if (!tree || nslots <= 0)
+        return NULL;
+    if (posix_memalign(&mem, 64, sizeof(c3bt_combiner)))
+        return NULL;
+    fc = mem;
+    memset(fc, 0, sizeof(c3bt_combiner));
+    fc->tree = tree;
+    fc->nslots = nslots;
+    fc->batch = malloc(nslots * sizeof(comb_slot*));
+    if (posix_memalign(&mem, 64, nslots * sizeof(comb_slot)))
+        mem = NULL;
+    fc->slots = mem;
+    if (!fc->batch || !fc->slots) {
+        c3bt_combiner_free(fc);
+        return NULL;
+    }
+    memset(fc->slots, 0, nslots * sizeof(comb_slot));
+    return fc;
+}
+
+void c3bt_combiner_free(c3bt_combiner *fc)
+{
+    if (!fc)
+        return;
+    free(fc->batch);
+    free(fc->slots);
+    free(fc);
+}
+
+/*
+ * Apply the posted ops, sorted so that neighbouring keys go in one after
+ * another while their cells are still in cache.  A batch has at most one op
+ * per slot, so insertion sort will do; it's stable, so ops on the same key
+ * keep the order of their slots.
+ */
+static void comb_run(c3bt_combiner *fc)
+{
+    c3bt_tree_impl *tree = (c3bt_tree_impl*)fc->tree;
+    comb_slot *slot, **batch = fc->batch;
+    int i, j, n, pass;
+
+    for (pass = 0; pass < COMB_PASSES; pass++) {
+        for (i = n = 0; i < fc->nslots; i++)
+            if (__atomic_load_n(&fc->slots[i].op, __ATOMIC_ACQUIRE))
+                batch[n++] = fc->slots + i;
+        if (!n)
+            break;
+        for (i = 1; i < n; i++) {
+            slot = batch[i];
+            for (j = i; j > 0
+                && bulk_cmp(tree, batch[j - 1]->uobj, slot->uobj) > 0; j--)
+                batch[j] = batch[j - 1];
+            batch[j] = slot;
         }
-        if (upper != INVALID_NODE) {
-            cur->cell = cell;
-            cur->nid = upper;
-            goto down;
+        for (i = 0; i < n; i++) {
+            slot = batch[i];
+            if (slot->op == COMB_ADD)
+                slot->result = c3bt_add(fc->tree, slot->uobj);
+            else
+                slot->result = c3bt_remove(fc->tree, slot->uobj);
+            __atomic_store_n(&slot->op, 0, __ATOMIC_RELEASE);
         }
-        cell = cell_parent(cell);
     }
-    return NULL;
+}
 
-    down:
+/* Post an op and wait until some combiner, maybe this thread, has done it. */
+static bool comb_post(c3bt_combiner *fc, void *uobj, int slot, uint32_t op)
+{
+    comb_slot *s;
+    int n;
 
-    lower = cur->cell->N[cur->nid].child[dir];
-    if (CHILD_IS_UOBJ(lower)) {
-        cur->cid = dir;
-        return cur->cell->P[lower & INDEX_MASK];
-    } else {
-        if (CHILD_IS_CELL(lower)) {
-            cur->cell = cur->cell->P[lower & INDEX_MASK];
-            cur->nid = 0;
-        } else
-            cur->nid = lower;
-        return tree_rush_down(tree, cur, 1 - dir);
+    if (!fc || !uobj || slot < 0 || slot >= fc->nslots)
+        return false;
+    s = fc->slots + slot;
+    s->uobj = uobj;
+    __atomic_store_n(&s->op, op, __ATOMIC_RELEASE);
+    for (n = 0; __atomic_load_n(&s->op, __ATOMIC_ACQUIRE); n++) {
+        if (!__atomic_load_n(&fc->lock, __ATOMIC_RELAXED)
+            && !__atomic_exchange_n(&fc->lock, 1, __ATOMIC_ACQUIRE)) {
+            comb_run(fc);
+            __atomic_store_n(&fc->lock, 0, __ATOMIC_RELEASE);
+        } else if (n >= COMB_SPIN) {
+            sched_yield();
+        }
     }
+    return s->result;
 }
 
-void *c3bt_prev(c3bt_tree *c3bt, c3bt_cursor *cur)
+bool c3bt_combine_add(c3bt_combiner *fc, void *uobj, int slot)
 {
-    return tree_step((c3bt_tree_impl*)c3bt, (c3bt_cursor_impl*)cur, 0);
+    return comb_post(fc, uobj, slot, COMB_ADD);
 }
 
-void *c3bt_next(c3bt_tree *c3bt, c3bt_cursor *cur)
+bool c3bt_combine_remove(c3bt_combiner *fc, void *uobj, int slot)
 {
-    return tree_step((c3bt_tree_impl*)c3bt, (c3bt_cursor_impl*)cur, 1);
+    return comb_post(fc, uobj, slot, COMB_REMOVE);
 }
+#endif
 
+#ifdef C3BT_WITH_THREADS
 /*
- * Find node's parent in a cell.
- *
- * Return value is in the form of parent_node_id<<1|which_child_i_am.  Note:
- * input can't be 0.
+ * Replicated trees.  Each replica is a tree of its own (with its own cells,
+ * on the same uobjs) enabled for RCU readers.  Writes go to an operation log,
+ * a ring of REPL_LOG_SIZE entries under the log lock; a replica applies the
+ * entries it hasn't seen yet under its own lock, as its one writer.  Replicas
+ * are caught up by readers on their node before they look up, and by writers
+ * on their node before they write, so cells are first touched, and thus
+ * placed, by the node that reads them.  The writer applies its op to its own
+ * replica first, and publishes it only if it succeeded there: the replicas
+ * then hold the same uobjs, so a replay can only fail for lack of memory.  A
+ * replica stops at an entry it can't apply and retries it at the next catch
+ * up; until then it's stale, and read locks on it fail.
  */
-static int cell_node_parent(c3bt_cell *cell, int node)
+#define REPL_LOG_SIZE       4096 /* a power of 2. */
+#define REPL_MAX_NODES      64
+#define REPL_MAX_CPUS       CPU_SETSIZE
+#define REPL_ADD            1
+#define REPL_REMOVE         2
+
+typedef struct repl_entry {
+    void *uobj;
+    uint32_t op;
+#ifdef _LP64
+    uint32_t reserved;
+#endif
+} repl_entry;
+
+typedef struct replica {
+    c3bt_tree tree;
+    pthread_mutex_t lock; /* held while applying the log. */
+    size_t applied; /* number of log entries applied. */
+} replica;
+
+struct c3bt_replicated {
+    replica **replicas;
+    repl_entry *log;
+    int *reader_replicas; /* the replica each reader is in. */
+    uint8_t *cpu_replicas; /* the replica of each CPU. */
+    size_t tail; /* number of log entries published. */
+    pthread_mutex_t log_lock;
+    int nreplicas;
+    int nreaders;
+    int sync;
+    int reserved;
+};
+
+/* Add the CPUs in a sysfs list like "0-3,8-11" to replica r. */
+static void repl_parse_cpus(uint8_t *map, const char *list, int r)
 {
-    int n, c;
+    char *end;
+    long lo, hi;
 
-    for (n = 0; n < NODES_PER_CELL; n++) {
-        if (cell_node_is_vacant(cell, n))
+    while (*list >= '0' && *list <= '9') {
+        lo = hi = strtol(list, &end, 10);
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (; lo <= hi && lo < REPL_MAX_CPUS; lo++)
+            map[lo] = r;
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Map the CPUs to replicas by NUMA node; return the number of nodes. */
+static int repl_map_cpus(uint8_t *map, int nreplicas)
+{
+    char path[64], list[4096];
+    FILE *f;
+    int node, n = 0;
+
+    for (node = 0; node < REPL_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+            node);
+        f = fopen(path, "r");
+        if (!f)
             continue;
-        for (c = 0; c < 2; c++)
-            if (cell->N[n].child[c] == node)
-                goto found;
+        if (fgets(list, sizeof(list), f) && nreplicas)
+            repl_parse_cpus(map, list, n % nreplicas);
+        fclose(f);
+        n++;
     }
+    return n ? n : 1;
+}
 
-    found:
+static int repl_local(c3bt_replicated *rp)
+{
+    int cpu = sched_getcpu();
 
-    return n << 1 | c;
+    return cpu >= 0 && cpu < REPL_MAX_CPUS ? rp->cpu_replicas[cpu] : 0;
+}
+
+static bool repl_op(replica *rep, void *uobj, uint32_t op)
+{
+    if (op == REPL_ADD)
+        return c3bt_add(&rep->tree, uobj);
+    return c3bt_remove(&rep->tree, uobj);
 }
 
 /*
- * Find a split point for a fully populated cell.  Return the would-be new cell
- * root and a bitmap representing the nodes to be moved.
+ * Apply the log up to end to a replica (locked).  Stop at an entry that fails
+ * (no memory), to be retried; return whether it reached end.  The writer may
+ * have taken the replica past end meanwhile.
  */
-static uint cell_find_split(c3bt_cell *cell, int *bitmap)
+static bool repl_apply(c3bt_replicated *rp, replica *rep, size_t end)
 {
-    uint8_t stack[NODES_PER_CELL - 2];
-    int i, top, n, c, count, ret_n, ret_bmp, offset;
+    repl_entry *e;
+    size_t i;
 
-    ret_n = ret_bmp = 0; /* shut compiler up. */
-    offset = NODES_PER_CELL;
-    for (i = NODES_PER_CELL - 1; i > 0; i--) {
-        if (!CHILD_IS_NODE(cell->N[i].child[0])
-            && !CHILD_IS_NODE(cell->N[i].child[1]))
-            continue;
-        /* Pre-order traversal to count nodes in a subtree.  Cell-root and edge
-         * nodes are excluded.
-         */
-        count = 1;
-        *bitmap = 0;
-        stack[0] = i;
-        top = 0;
-        while (top >= 0) {
-            n = stack[top--];
-            *bitmap |= 0x8000u >> n;
-            for (c = 1; c >= 0; c--)
-                if (CHILD_IS_NODE(cell->N[n].child[c])) {
-                    stack[++top] = cell->N[n].child[c];
-                    count++;
-                }
-        }
-        /* Calculate deviation from perfect split. */
-        c = count * 2 - NODES_PER_CELL;
-        c = __builtin_abs(c);
-        if (c == NODES_PER_CELL % 2)
-            return i;
-        if (c < offset) {
-            offset = c;
-            ret_n = i;
-            ret_bmp = *bitmap;
-        }
+    for (i = rep->applied; i < end; i++) {
+        e = rp->log + (i & (REPL_LOG_SIZE - 1));
+        if (!repl_op(rep, e->uobj, e->op))
+            break;
     }
-    *bitmap = ret_bmp;
-    return ret_n;
+    __atomic_store_n(&rep->applied, i, __ATOMIC_RELEASE);
+    return i >= end;
 }
 
-/*
- * Split a full cell in two.  New cell will become original cell's sub-cell.
- */
-static bool cell_split(c3bt_cell *cell)
+/* Bring a replica up to date; return false if it's left stale. */
+static bool repl_catch_up(c3bt_replicated *rp, int r)
 {
-    c3bt_cell *new_cell;
-    int i, c, p, anchor, new_root, count, bitmap;
+    replica *rep = rp->replicas[r];
+    size_t tail = __atomic_load_n(&rp->tail, __ATOMIC_ACQUIRE);
+    bool ok;
 
-    new_cell = cell_malloc();
-    if (!new_cell)
-        return false;
+    if (__atomic_load_n(&rep->applied, __ATOMIC_ACQUIRE) >= tail)
+        return true;
+    pthread_mutex_lock(&rep->lock);
+    ok = repl_apply(rp, rep, tail);
+    pthread_mutex_unlock(&rep->lock);
+    return ok;
+}
 
-    new_root = cell_find_split(cell, &bitmap);
-    count = 0;
-    for (i = 0; i < NODES_PER_CELL; i++) {
-        if (!(bitmap & (0x8000u >> i)))
-            continue;
-        /* Move node[i] and its children to new cell (same location) */
-        new_cell->N[i] = cell->N[i];
-        for (c = 0; c < 2; c++) {
-            p = cell->N[i].child[c];
-            if (!CHILD_IS_NODE(p)) {
-                if (CHILD_IS_CELL(p))
-                    cell_set_parent(cell->P[p & INDEX_MASK], new_cell);
-                p &= INDEX_MASK;
-                new_cell->P[p] = cell->P[p];
-                cell_free_ptr(cell, p);
-            }
+c3bt_replicated *c3bt_replicated_new(uint kdt, uint koffset, uint kbits,
+    int nreplicas, int nreaders, bool sync)
+{
+    c3bt_replicated *rp;
+    void *mem;
+
+    if (nreaders <= 0)
+        return NULL;
+    rp = calloc(1, sizeof(c3bt_replicated));
+    if (!rp)
+        return NULL;
+    rp->cpu_replicas = calloc(REPL_MAX_CPUS, 1);
+    if (!rp->cpu_replicas)
+        goto fail;
+    if (nreplicas <= 0)
+        nreplicas = repl_map_cpus(rp->cpu_replicas, 0);
+    if (nreplicas > REPL_MAX_NODES)
+        nreplicas = REPL_MAX_NODES;
+    repl_map_cpus(rp->cpu_replicas, nreplicas);
+    rp->nreaders = nreaders;
+    rp->sync = sync;
+    pthread_mutex_init(&rp->log_lock, NULL);
+    rp->log = malloc(REPL_LOG_SIZE * sizeof(repl_entry));
+    rp->reader_replicas = calloc(nreaders, sizeof(int));
+    rp->replicas = calloc(nreplicas, sizeof(replica*));
+    if (!rp->log || !rp->reader_replicas || !rp->replicas)
+        goto fail;
+    for (; rp->nreplicas < nreplicas; rp->nreplicas++) {
+        if (posix_memalign(&mem, 64, (sizeof(replica) + 63) & ~63))
+            goto fail;
+        memset(mem, 0, sizeof(replica));
+        if (!c3bt_init(&((replica*)mem)->tree, kdt, koffset, kbits)
+            || !c3bt_rcu_enable(&((replica*)mem)->tree, nreaders)) {
+            c3bt_destroy(&((replica*)mem)->tree);
+            free(mem);
+            goto fail;
         }
-        count++;
-        cell_free_node(cell, i);
+        pthread_mutex_init(&((replica*)mem)->lock, NULL);
+        rp->replicas[rp->nreplicas] = mem;
     }
+    return rp;
 
-    /* Fix old cell. */
-    p = cell_alloc_ptr(cell);
-    cell->P[p] = new_cell;
-    anchor = cell_node_parent(cell, new_root);
-    cell->N[anchor >> 1].child[anchor & 1] = CHILD_CELL_BIT | p;
-    cell_dec_ncount(cell, count);
-
-    /* Fix new cell. */
-    new_cell->N[0] = new_cell->N[new_root];
-    cell_free_node(new_cell, new_root);
-    new_cell->pnc = cell_make_pnc(cell, count);
-    return true;
+fail:
+    c3bt_replicated_free(rp);
+    return NULL;
 }
 
-/*
- * Try to push down a node from a full cell.
- */
-static bool cell_push_down(c3bt_cell *cell)
+void c3bt_replicated_free(c3bt_replicated *rp)
 {
-    int n, np, c, sibling, old_root, new_ptr;
-    c3bt_cell *sub;
+    int r;
 
-    for (n = 1; n < NODES_PER_CELL; n++) {
-        /* All nodes are taken, no need for vacancy test.*/
-        for (c = 0; c < 2; c++) {
-            /* Only edge nodes can be pushed down. */
-            if (CHILD_IS_CELL(cell->N[n].child[c])
-                && !CHILD_IS_NODE(cell->N[n].child[1 - c])) {
-                sub = cell->P[cell->N[n].child[c] & INDEX_MASK];
-                if (cell_ncount(sub) < NODES_PER_CELL) {
-                    sibling = cell->N[n].child[1 - c];
-                    old_root = cell_alloc_node(sub);
-                    new_ptr = cell_alloc_ptr(sub);
-                    cell_inc_ncount(sub, 1);
-                    np = cell_node_parent(cell, n);
-                    cell->N[np >> 1].child[np & 1] = cell->N[n].child[c];
-                    sub->N[old_root] = sub->N[0];
-                    sub->P[new_ptr] = cell->P[sibling & INDEX_MASK];
-                    sub->N[0].cbit = cell->N[n].cbit;
-                    sub->N[0].child[c] = old_root;
-                    sub->N[0].child[1 - c] = (sibling & FLAGS_MASK) | new_ptr;
-                    if (CHILD_IS_CELL(sibling))
-                        cell_set_parent(sub->P[new_ptr], sub);
-                    cell_free_node(cell, n);
-                    cell_free_ptr(cell, sibling & INDEX_MASK);
-                    cell_dec_ncount(cell, 1);
-#ifdef C3BT_STATS
-                    c3bt_stat_pushdowns++;
-#endif
-                    return true;
-                }
-            }
-        }
+    if (!rp)
+        return;
+    for (r = 0; r < rp->nreplicas; r++) {
+        c3bt_destroy(&rp->replicas[r]->tree);
+        pthread_mutex_destroy(&rp->replicas[r]->lock);
+        free(rp->replicas[r]);
     }
-    return false;
+    pthread_mutex_destroy(&rp->log_lock);
+    free(rp->replicas);
+    free(rp->log);
+    free(rp->reader_replicas);
+    free(rp->cpu_replicas);
+    free(rp);
 }
 
-bool c3bt_add(c3bt_tree *c3bt, void *uobj)
+int c3bt_replicated_nreplicas(c3bt_replicated *rp)
 {
-    c3bt_tree_impl *tree;
-    c3bt_cursor_impl cur;
-    void *robj;
-    int cbit_nr, bit, new_node, new_ptr, lower;
+    return rp ? rp->nreplicas : 0;
+}
 
-    if (!c3bt || !uobj)
+int c3bt_replicated_local(c3bt_replicated *rp)
+{
+    return rp ? repl_local(rp) : -1;
+}
+
+c3bt_tree *c3bt_replicated_tree(c3bt_replicated *rp, int replica)
+{
+    if (!rp || replica < 0 || replica >= rp->nreplicas)
+        return NULL;
+    return &rp->replicas[replica]->tree;
+}
+
+static bool repl_write(c3bt_replicated *rp, void *uobj, uint32_t op)
+{
+    replica *rep;
+    size_t t;
+    bool ok = false;
+    int r;
+
+    if (!rp || !uobj)
         return false;
-    tree = (c3bt_tree_impl*)c3bt;
-    /* Empty -> singleton. */
-    if (!tree->root) {
-        cur.cell = cell_malloc();
-        if (!cur.cell)
-            return false;
-        tree->root = cur.cell;
-        cur.cell->N[0].child[0] = CHILD_UOBJ_BIT | 0;
-        cur.cell->N[0].child[1] = CHILD_CELL_BIT | 1;
-        cur.cell->P[0] = uobj;
-        /* Redundant for a new cell:
-         * cur.cell->P[1] = NULL;
-         * cur.cell->pnc = cell_make_pnc(NULL, 1);
-         */
-#ifdef C3BT_STATS
-        c3bt_stat_cells = 1;
-#endif
-        goto done;
+    pthread_mutex_lock(&rp->log_lock);
+    t = rp->tail;
+    /* The entry to overwrite must have been applied everywhere. */
+    for (r = 0; r < rp->nreplicas; r++)
+        if (t - __atomic_load_n(&rp->replicas[r]->applied, __ATOMIC_ACQUIRE)
+            >= REPL_LOG_SIZE && !repl_catch_up(rp, r))
+            goto done;
+    /* Try it on the local replica, and log it only if it succeeds. */
+    rep = rp->replicas[repl_local(rp)];
+    pthread_mutex_lock(&rep->lock);
+    if (repl_apply(rp, rep, t) && repl_op(rep, uobj, op)) {
+        rp->log[t & (REPL_LOG_SIZE - 1)].uobj = uobj;
+        rp->log[t & (REPL_LOG_SIZE - 1)].op = op;
+        __atomic_store_n(&rep->applied, t + 1, __ATOMIC_RELEASE);
+        ok = true;
     }
-    robj = tree_lookup(tree, (char*)uobj + tree->key_offset, &cur);
-    cbit_nr = tree->bitops(-(tree->key_nbits + 1),
-        (char*)uobj + tree->key_offset, (char*)robj + tree->key_offset);
-    if (cbit_nr == -1)
-        return false;
-    bit = tree->bitops(cbit_nr, (char*)uobj + tree->key_offset, NULL);
-    /* Add to singleton. */
-    if (tree->n_objects == 1) {
-        tree->root->P[1] = uobj;
-        tree->root->N[0].cbit = cbit_nr;
-        tree->root->N[0].child[bit] = CHILD_UOBJ_BIT | 1;
-        tree->root->N[0].child[1 - bit] = CHILD_UOBJ_BIT | 0;
+    pthread_mutex_unlock(&rep->lock);
+    if (!ok)
         goto done;
-    }
-    /* Find insertion point. */
-    if (cbit_nr > cur.cell->N[cur.nid].cbit) {
-        /* No need to search from root. */
-        lower = cur.cell->N[cur.nid].child[cur.cid];
-    } else {
-        /* Find location for new node.  We need to start from tree root because
-         * it must follow the correct path.  Since we may insert a node with
-         * large cbit number in a high cell, upwards cell-by-cell searching
-         * won't work.
-         */
-        cur.cell = tree->root;
+    __atomic_store_n(&rp->tail, t + 1, __ATOMIC_RELEASE);
+    if (rp->sync)
+        for (r = 0; r < rp->nreplicas; r++)
+            repl_catch_up(rp, r);
 
-        next:
+    done:
 
-        cur.nid = INVALID_NODE;
-        lower = 0;
-        while (!CHILD_IS_UOBJ(lower)) {
-            if (cur.cell->N[lower].cbit > cbit_nr)
-                break;
-            cur.nid = lower;
-            cur.cid = tree->bitops(cur.cell->N[lower].cbit,
-                (char*)uobj + tree->key_offset, NULL);
-            lower = cur.cell->N[lower].child[cur.cid];
-            if (CHILD_IS_CELL(lower)) {
-                cur.cell = cur.cell->P[lower & INDEX_MASK];
-                goto next;
-            }
-        }
-    }
-    /* Make room for a full cell.  Re-searching the cell afterwards is necessary
-     * because we don't know if the insertion point has been moved out.
-     */
-    if (cell_ncount(cur.cell) == NODES_PER_CELL) {
-        /* Try to push down a node first; it's cheaper. */
-        if (cell_push_down(cur.cell))
-            goto next;
-        /* Then we have to split. */
-        if (!cell_split(cur.cell))
-            return false;
-#ifdef C3BT_STATS
-        c3bt_stat_cells++;
-        c3bt_stat_splits++;
+    pthread_mutex_unlock(&rp->log_lock);
+    return ok;
+}
+
+bool c3bt_replicated_add(c3bt_replicated *rp, void *uobj)
+{
+    return repl_write(rp, uobj, REPL_ADD);
+}
+
+bool c3bt_replicated_remove(c3bt_replicated *rp, void *uobj)
+{
+    return repl_write(rp, uobj, REPL_REMOVE);
+}
+
+bool c3bt_replicated_sync(c3bt_replicated *rp)
+{
+    bool ok = true;
+    int r;
+
+    for (r = 0; rp && r < rp->nreplicas; r++)
+        if (!repl_catch_up(rp, r))
+            ok = false;
+    return ok;
+}
+
+c3bt_tree *c3bt_replicated_read_lock(c3bt_replicated *rp, int reader,
+    int replica)
+{
+    if (!rp || reader < 0 || reader >= rp->nreaders
+        || replica >= rp->nreplicas)
+        return NULL;
+    if (replica < 0)
+        replica = repl_local(rp);
+    if (!repl_catch_up(rp, replica))
+        return NULL;
+    rp->reader_replicas[reader] = replica;
+    c3bt_read_lock(&rp->replicas[replica]->tree, reader);
+    return &rp->replicas[replica]->tree;
+}
+
+void c3bt_replicated_read_unlock(c3bt_replicated *rp, int reader)
+{
+    if (!rp || reader < 0 || reader >= rp->nreaders)
+        return;
+    c3bt_read_unlock(&rp->replicas[rp->reader_replicas[reader]]->tree,
+        reader);
+}
 #endif
-        goto next;
-    }
-    new_node = cell_alloc_node(cur.cell);
-    new_ptr = cell_alloc_ptr(cur.cell);
-    cell_inc_ncount(cur.cell, 1);
-    cur.cell->P[new_ptr] = uobj;
-    if (cur.nid == INVALID_NODE) {
-        /* Insert as cell root. */
-        cur.cell->N[new_node] = cur.cell->N[0];
-        lower = new_node;
-        new_node = 0;
-    }
-    /* Insert between cur.nid and lower. */
-    cur.cell->N[new_node].cbit = cbit_nr;
-    if (cur.nid != INVALID_NODE)
-        cur.cell->N[cur.nid].child[cur.cid] = new_node;
-    cur.cell->N[new_node].child[bit] = new_ptr | CHILD_UOBJ_BIT;
-    cur.cell->N[new_node].child[1 - bit] = lower;
 
-    done:
+/*
+ * Standard bitops for common data types.
+ */
+
+/*
+ * Crit-bit kernels: the offset of the first byte where p and q differ among the
+ * first n, or n if there's none.  The string ones also stop at the first NUL of
+ * p, which then is a NUL of q too if they don't differ there.  The scalar
+ * kernels compare a word at a time; SSE2 and AVX2 ones 16 and 32 bytes.
+ * String kernels may read past the NUL, so each load is kept within a page.
+ */
+static inline _inline size_t first_byte(uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_ctzll(x) / 8;
+#else
+    return __builtin_clzll(x) / 8;
+#endif
+}
+
+static inline _inline bool page_tail(const uint8_t *p, uint width)
+{
+    return ((uintptr_t)p & 4095) > 4096 - width;
+}
 
-    tree->n_objects++;
-    return true;
+static size_t mismatch_word(const uint8_t *p, const uint8_t *q, size_t n)
+{
+    uint64_t w1, w2;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        memcpy(&w1, p + i, 8);
+        memcpy(&w2, q + i, 8);
+        if (w1 != w2)
+            return i + first_byte(w1 ^ w2);
+    }
+    for (; i < n; i++)
+        if (p[i] != q[i])
+            break;
+    return i;
 }
 
-/*
- * Find the anchor point (return as nid<<1|cid) in parent cell.
- * Note: cell must not be the root cell.
- */
-static int cell_find_anchor(c3bt_cell *cell, c3bt_cell *parent)
+#if defined(C3BT_WITH_STRING) && !defined(__SSE2__)
+_overread
+static size_t str_mismatch_word(const uint8_t *p, const uint8_t *q, size_t n)
 {
-    int i;
-    uint nid, cid;
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7Full;
+    uint64_t w1, w2, x;
+    size_t i = 0;
 
-    for (i = 0; parent->P[i] != cell; i++)
-        /* nothing */;
-    i |= CHILD_CELL_BIT;
-    for (nid = 0; nid < NODES_PER_CELL; nid++) {
-        if (cell_node_is_vacant(parent, nid))
+    while (i < n) {
+        if (page_tail(p + i, 8) || page_tail(q + i, 8)) {
+            if (p[i] != q[i] || !p[i])
+                break;
+            i++;
             continue;
-        for (cid = 0; cid < 2; cid++)
-            if (parent->N[nid].child[cid] == i)
-                goto found;
+        }
+        memcpy(&w1, p + i, 8);
+        memcpy(&w2, q + i, 8);
+        /* 0x80 in the differing bytes and the NULs of w1. */
+        x = (w1 ^ w2) | ~(((w1 & low7) + low7) | w1 | low7);
+        if (x) {
+            i += first_byte(x);
+            break;
+        }
+        i += 8;
     }
+    return i < n ? i : n;
+}
+#endif
 
-    found:
+#ifdef __SSE2__
+static size_t mismatch_sse2(const uint8_t *p, const uint8_t *q, size_t n)
+{
+    uint m;
+    size_t i;
 
-    return nid << 1 | cid;
+    for (i = 0; i + 16 <= n; i += 16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i*)(p + i)),
+            _mm_loadu_si128((const __m128i*)(q + i)))) ^ 0xFFFF;
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + mismatch_word(p + i, q + i, n - i);
 }
 
-/*
- * Merge a cell into its parent cell.
- *
- * Iterative post-order traversal using two stacks.  Sizes of the stacks are
- * fixed and are set for largest possible cell (with NODES_PER_CELL-1 nodes).
- * This function uses about 92B stack on x86 and 64B on ARM, which is less than
- * 1/3 of the recursive equivalent under worst condition.
- */
-static void cell_merge(c3bt_cell *cell, c3bt_cell *parent, int anchor)
+#ifdef C3BT_WITH_STRING
+_overread
+static size_t str_mismatch_sse2(const uint8_t *p, const uint8_t *q, size_t n)
 {
-    int wtop, ftop, n, c, new_node, new_ptr;
-    uint8_t wstack[NODES_PER_CELL];
-    uint8_t fstack[NODES_PER_CELL * 2 - 1];
+    __m128i a;
+    uint m;
+    size_t i = 0;
 
-    cell_free_ptr(parent,
-        parent->N[anchor >> 1].child[anchor & 1] & INDEX_MASK);
-    /* Use wstack to make a full post-order stack in fstack. */
-    ftop = -1;
-    wtop = 0;
-    wstack[0] = 0;
-    while (wtop >= 0) {
-        n = wstack[wtop--];
-        fstack[++ftop] = n;
-        if (CHILD_IS_NODE(n))
-            for (c = 0; c < 2; c++)
-                wstack[++wtop] = cell->N[n].child[c];
-    }
-    /* Copy everything in full stack. */
-    while (ftop >= 0) {
-        n = fstack[ftop];
-        if (CHILD_IS_NODE(n)) {
-            /* Copy a node with its children, and replace with its new index in
-             * parent cell.
-             */
-            new_node = cell_alloc_node(parent);
-            cell_inc_ncount(parent, 1);
-            parent->N[new_node].cbit = cell->N[n].cbit;
-            wtop = ftop + 1;
-            for (c = 1; c >= 0; c--) {
-                while (fstack[wtop] == INVALID_NODE)
-                    wtop++;
-                parent->N[new_node].child[c] = fstack[wtop];
-                fstack[wtop] = INVALID_NODE;
-            }
-            fstack[ftop] = new_node;
-        } else {
-            /* Copy a pointer and replace with its new index in parent cell. */
-            new_ptr = cell_alloc_ptr(parent);
-            c = n & INDEX_MASK;
-            parent->P[new_ptr] = cell->P[c];
-            if (CHILD_IS_CELL(n))
-                cell_set_parent(cell->P[c], parent);
-            fstack[ftop] = (n & FLAGS_MASK) | new_ptr;
+    while (i < n) {
+        if (page_tail(p + i, 16) || page_tail(q + i, 16)) {
+            if (p[i] != q[i] || !p[i])
+                break;
+            i++;
+            continue;
         }
-        ftop--;
+        a = _mm_loadu_si128((const __m128i*)(p + i));
+        m = (_mm_movemask_epi8(_mm_cmpeq_epi8(a,
+            _mm_loadu_si128((const __m128i*)(q + i)))) ^ 0xFFFF)
+            | _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128()));
+        if (m) {
+            i += __builtin_ctz(m);
+            break;
+        }
+        i += 16;
     }
-    parent->N[anchor >> 1].child[anchor & 1] = fstack[0];
-    cell_free(cell);
+    return i < n ? i : n;
 }
+#endif
 
-bool c3bt_remove(c3bt_tree *c3bt, void *uobj)
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const uint8_t *p, const uint8_t *q, size_t n)
 {
-    c3bt_tree_impl *tree;
-    c3bt_cursor_impl loc;
-    c3bt_cell *parent, *sub;
-    uint8_t *pap;
-    int n, c, sibling, anchor;
+    uint m;
+    size_t i;
 
-    if (!c3bt_locate(c3bt, uobj, (c3bt_cursor*)&loc))
-        return false;
-    tree = (c3bt_tree_impl*)c3bt;
-    parent = cell_parent(loc.cell);
-    cell_free_ptr(loc.cell, loc.cell->N[loc.nid].child[loc.cid] & INDEX_MASK);
-    if (!loc.nid) {
-        /* Remove from cell root. */
-        sibling = loc.cell->N[0].child[1 - loc.cid];
-        if (CHILD_IS_NODE(sibling)) {
-            /* Sibling is a node: promote it to cell root. */
-            loc.cell->N[0] = loc.cell->N[sibling];
-            cell_free_node(loc.cell, sibling);
-        } else if (CHILD_IS_UOBJ(sibling) && !parent) {
-            /* Root cell has two uobjs: turn to singleton tree. */
-            loc.cell->N[0].child[0] = CHILD_UOBJ_BIT | 0;
-            loc.cell->N[0].child[1] = CHILD_CELL_BIT | 1;
-            loc.cell->P[0] = loc.cell->P[sibling & INDEX_MASK];
-            loc.cell->P[1] = NULL;
-            goto done;
-        } else {
-            if (!parent) {
-                /* Root cell has a single node, one child being uobj pointer
-                 * (being removed) and another is a cell pointer.  This
-                 * condition also covers the singleton case.
-                 */
-                tree->root = loc.cell->P[sibling & INDEX_MASK];
-                if (tree->root)
-                    cell_set_parent(tree->root, NULL);
-            } else {
-                /* Non-root cell is becoming incomplete; push up then free. */
-                anchor = cell_find_anchor(loc.cell, parent);
-                pap = &parent->N[anchor >> 1].child[anchor & 1];
-                *pap &= INDEX_MASK;
-                parent->P[*pap] = loc.cell->P[sibling & INDEX_MASK];
-                if (CHILD_IS_CELL(sibling))
-                    cell_set_parent(parent->P[*pap], parent);
-                *pap |= sibling & FLAGS_MASK;
-#ifdef C3BT_STATS
-                c3bt_stat_pushups++;
-#endif
-            }
-            cell_free(loc.cell);
-#ifdef C3BT_STATS
-            c3bt_stat_cells--;
-#endif
-            goto done;
-        }
-    } else {
-        /* Not removing from cell root. */
-        n = cell_node_parent(loc.cell, loc.nid);
-        loc.cell->N[n >> 1].child[n & 1] = loc.cell->N[loc.nid].child[1
-            - loc.cid];
-        cell_free_node(loc.cell, loc.nid);
+    for (i = 0; i + 32 <= n; i += 32) {
+        m = ~(uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(p + i)),
+            _mm256_loadu_si256((const __m256i*)(q + i))));
+        if (m)
+            return i + __builtin_ctz(m);
     }
-    cell_dec_ncount(loc.cell, 1);
+    return i + mismatch_sse2(p + i, q + i, n - i);
+}
 
-    /* Try merging up to parent. */
-    if (parent && cell_ncount(loc.cell) + cell_ncount(parent) <= NODES_PER_CELL) {
-        anchor = cell_find_anchor(loc.cell, parent);
-        cell_merge(loc.cell, parent, anchor);
-        goto merge_done;
-    }
-    /* Try merging up a sub-cell. */
-    for (n = 0; n < NODES_PER_CELL; n++) {
-        if (cell_node_is_vacant(loc.cell, n))
+#ifdef C3BT_WITH_STRING
+_overread __attribute__((target("avx2")))
+static size_t str_mismatch_avx2(const uint8_t *p, const uint8_t *q, size_t n)
+{
+    __m256i a;
+    uint m;
+    size_t i = 0;
+
+    while (i < n) {
+        if (page_tail(p + i, 32) || page_tail(q + i, 32)) {
+            if (p[i] != q[i] || !p[i])
+                break;
+            i++;
             continue;
-        for (c = 0; c < 2; c++) {
-            if (CHILD_IS_CELL(loc.cell->N[n].child[c])) {
-                sub = loc.cell->P[loc.cell->N[n].child[c] & INDEX_MASK];
-                if (cell_ncount(loc.cell) + cell_ncount(sub) <= NODES_PER_CELL) {
-                    cell_merge(sub, loc.cell, n << 1 | c);
-                    goto merge_done;
-                }
-            }
         }
+        a = _mm256_loadu_si256((const __m256i*)(p + i));
+        m = ~(uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a,
+            _mm256_loadu_si256((const __m256i*)(q + i))))
+            | (uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a,
+            _mm256_setzero_si256()));
+        if (m) {
+            i += __builtin_ctz(m);
+            break;
+        }
+        i += 32;
     }
-    goto done;
-
-    merge_done:
-
-#ifdef C3BT_STATS
-    c3bt_stat_merges++;
-    c3bt_stat_cells--;
+    return i < n ? i : n;
+}
 #endif
+#endif /* __SSE2__ */
 
-    done:
+#ifdef __SSE2__
+static size_t (*mismatch)(const uint8_t *, const uint8_t *, size_t) =
+    mismatch_sse2;
+#ifdef C3BT_WITH_STRING
+static size_t (*str_mismatch)(const uint8_t *, const uint8_t *, size_t) =
+    str_mismatch_sse2;
+#endif
+#else
+static size_t (*mismatch)(const uint8_t *, const uint8_t *, size_t) =
+    mismatch_word;
+#ifdef C3BT_WITH_STRING
+static size_t (*str_mismatch)(const uint8_t *, const uint8_t *, size_t) =
+    str_mismatch_word;
+#endif
+#endif
 
-    tree->n_objects--;
-    return true;
+/* Pick the crit-bit kernels by CPU features; called by c3bt_init(). */
+static void crit_select(void)
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mismatch = mismatch_avx2;
+#ifdef C3BT_WITH_STRING
+        str_mismatch = str_mismatch_avx2;
+#endif
+    }
+#endif
 }
 
-/*
- * Standard bitops for common data types.
- */
-
 /*
  * BITS' length is fixed in tree structure.  The tail byte is zero-padded.
  */
 static int bitops_bits(int req, void *key1, void*key2)
 {
-    uint i, x;
+    uint8_t *p = key1, *q = key2;
+    size_t i, n;
+
     if (req >= 0) {
-        return ((uint8_t*)key1)[req / 8] & (0x80u >> (req % 8)) ? 1 : 0;
+        return p[req / 8] & (0x80u >> (req % 8)) ? 1 : 0;
     } else {
         /* For crit_bit request, req is passed with -(tree->key_nbits+1), hence
          * -req-1 is tree->key_nbits, so we know how far to compare.
          */
-        for (i = 0; i < (-req - 1 + 7) / 8; i++) {
-            if ((x = ((uint8_t*)key1)[i] ^ ((uint8_t*)key2)[i]) != 0)
-                return i * 8 + __builtin_clz(x) - 24;
-        }
-        return -1;
+        n = (-req - 1 + 7) / 8;
+        if ((i = mismatch(p, q, n)) == n)
+            return -1;
+        return i * 8 + __builtin_clz(p[i] ^ q[i]) - 24;
     }
 }
 
@@ -1188,36 +5799,146 @@ static int bitops_bits(int req, void *key1, void*key2)
 #ifdef C3BT_WITH_STRING
 static int bitops_str(int req, void *key1, void *key2)
 {
-    uint i, nbits;
-    char *q, *p = (char*)key1;
+    size_t i, n;
+    uint nbits;
+    uint8_t *q, *p = (uint8_t*)key1;
 
     if (req >= 0) {
-        nbits = strlen(p) * 8;
-        if (req >= nbits)
+        /* Don't take the whole length: only the bytes up to req/8 matter. */
+        if (strnlen((char*)p, req / 8 + 1) <= (uint)req / 8)
             return 0;
         return p[req / 8] & (0x80u >> (req % 8)) ? 1 : 0;
     } else {
-        q = (char*)key2;
+        q = (uint8_t*)key2;
         /* Compare up to specified number of bits (exactly), if can't find a
          * differing bit, report they are equal.
          */
-        for (i = 0; i < (-req - 1 + 7) / 8; i++) {
-            if ((p[i] | q[i]) == 0)
-                return -1;
-            if (p[i] == q[i])
-                continue;
-            if (p[i] == 0 || q[i] == 0) {
-                nbits = i * 8 + __builtin_clz((uint32_t)(p[i] ^ q[i])) - 24;
-                return nbits >= (-req - 1) ? -1 : nbits;
-            }
-        }
-        return -1;
+        n = (-req - 1 + 7) / 8;
+        i = str_mismatch(p, q, n);
+        if (i == n || p[i] == q[i])
+            return -1;
+        nbits = i * 8 + __builtin_clz(p[i] ^ q[i]) - 24;
+        return nbits >= (uint)(-req - 1) ? -1 : (int)nbits;
     }
 }
 
 static int bitops_pstr(int req, void *key1, void*key2)
 {
-    return bitops_str(req, *(void**)key1, *(void**)key2);
+    return bitops_str(req, *(void**)key1, req >= 0 ? NULL : *(void**)key2);
+}
+
+/*
+ * HSTR is STR with the bytes past the head (HSTR_HEAD bytes, the key bits less
+ * 64) replaced by a 64-bit hash of them, so strings longer than the key bits
+ * are still told apart.  They sort by the head, and among those sharing it, in
+ * an arbitrary but stable order of the hash.  The hash is 0 only for strings
+ * that fit in the head.  Two strings with the same head and hash are the same
+ * key, and c3bt_add() rejects the second one as a duplicate.
+ */
+static uint64_t hstr_hash(const uint8_t *str)
+{
+    const uint8_t *s;
+    size_t n;
+    uint64_t h, w;
+
+    if (strnlen((char*)str, HSTR_HEAD + 1) <= HSTR_HEAD)
+        return 0;
+    s = str + HSTR_HEAD;
+    n = strlen((char*)s);
+    h = n * 0x9E3779B97F4A7C15ull;
+    for (; n >= 8; n -= 8, s += 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    if (n) {
+        w = 0;
+        memcpy(&w, s, n);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    }
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 32;
+    return h ? h : 1;
+}
+
+/*
+ * The crit-bit of two string keys of a kind, as by bitops with req -(nbits + 1);
+ * HSTR hashes are taken only if the heads are the same, and once per str_key.
+ */
+static int str_crit(str_key *sk1, str_key *sk2, int nbits)
+{
+    uint8_t *p = sk1->str, *q = sk2->str;
+    size_t i;
+    uint64_t x;
+
+    if (sk1->tail < 0)
+        return bitops_str(-(nbits + 1), p, q);
+    i = str_mismatch(p, q, HSTR_HEAD);
+    if (i < HSTR_HEAD) {
+        if (p[i] == q[i])
+            return -1;
+        return i * 8 + __builtin_clz(p[i] ^ q[i]) - 24;
+    }
+    if ((x = str_hash(sk1) ^ str_hash(sk2)) == 0)
+        return -1;
+    return HSTR_HEAD * 8 + __builtin_clzll(x);
+}
+
+static int bitops_hstr(int req, void *key1, void *key2)
+{
+    str_key sk1, sk2;
+
+    if (req >= 0) {
+        if (req < HSTR_HEAD * 8)
+            return bitops_str(req, key1, NULL);
+        return hstr_hash(key1) >> (63 - (req - HSTR_HEAD * 8)) & 1;
+    }
+    str_key_init(&sk1, key1, true);
+    str_key_init(&sk2, key2, true);
+    return str_crit(&sk1, &sk2, 0);
+}
+
+static int bitops_phstr(int req, void *key1, void*key2)
+{
+    return bitops_hstr(req, *(void**)key1, req >= 0 ? NULL : *(void**)key2);
+}
+
+/*
+ * BLOB is variable length, and NUL is a byte like any other, so the end can't
+ * be told by padding.  Each byte is presented as 9 bits, a 1 "more" bit then
+ * the byte, and past the end all bits are 0: a blob sorts before the longer
+ * ones it is a prefix of, and otherwise bytewise.
+ */
+static int bitops_blob(int req, void *key1, void *key2)
+{
+    c3bt_blob *b1 = key1, *b2 = key2;
+    const uint8_t *p, *q;
+    size_t i, n;
+    uint nbits;
+
+    p = b1->data;
+    if (req >= 0) {
+        i = (uint)req / 9;
+        if (i >= b1->len)
+            return 0;
+        if (req % 9 == 0)
+            return 1;
+        return p[i] & (0x100u >> (req % 9)) ? 1 : 0;
+    }
+    q = b2->data;
+    n = b1->len < b2->len ? b1->len : b2->len;
+    /* Bytes past the number of bits to compare don't matter. */
+    if (n > ((uint)(-req - 1) + 8) / 9)
+        n = ((uint)(-req - 1) + 8) / 9;
+    if ((i = mismatch(p, q, n)) == n) {
+        /* One is a prefix of the other: they differ on the "more" bit. */
+        if (b1->len == b2->len || i * 9 >= (uint)(-req - 1))
+            return -1;
+        return i * 9;
+    }
+    nbits = i * 9 + 1 + __builtin_clz(p[i] ^ q[i]) - 24;
+    return nbits >= (uint)(-req - 1) ? -1 : (int)nbits;
 }
 #endif
 
@@ -1326,4 +6047,94 @@ static int bitops_s64(int req, void *key1, void *key2)
 }
 #endif
 
+#ifdef C3BT_WITH_FLOATS
+static int bitops_f32(int req, void *key1, void *key2)
+{
+    uint32_t bits;
+
+    bits = f32_order(*(uint32_t*)key1);
+    if (req >= 0)
+        return bits & (0x80000000u >> req) ? 1 : 0;
+    bits ^= f32_order(*(uint32_t*)key2);
+    if (bits == 0)
+        return -1;
+    return __builtin_clz(bits);
+}
+
+static int bitops_f64(int req, void *key1, void *key2)
+{
+    uint64_t bits;
+
+    bits = f64_order(*(uint64_t*)key1);
+    if (req >= 0)
+        return (bits << req) >> 63;
+    bits ^= f64_order(*(uint64_t*)key2);
+    if (bits == 0)
+        return -1;
+    return __builtin_clzll(bits);
+}
+#endif
+
+#ifdef C3BT_WITH_LPM
+/*
+ * Address prefixes are compared as addr[0, len) "1" "0...", left-aligned in 64
+ * bit words: 33 bits for LPM32, 129 for LPM128.
+ */
+static uint64_t lpm32_encode(c3bt_prefix32 *key)
+{
+    uint len;
+
+    len = key->len > 32 ? 32 : key->len;
+    return (len ? (uint64_t)(key->addr & ~0u << (32 - len)) << 32 : 0)
+        | 0x8000000000000000ull >> len;
+}
+
+static int bitops_lpm32(int req, void *key1, void *key2)
+{
+    uint64_t bits;
+
+    bits = lpm32_encode(key1);
+    if (req >= 0)
+        return (bits << req) >> 63;
+    bits ^= lpm32_encode(key2);
+    if (bits == 0)
+        return -1;
+    return __builtin_clzll(bits);
+}
+
+static void lpm128_encode(c3bt_prefix128 *key, uint64_t *w)
+{
+    uint len;
+
+    len = key->len > 128 ? 128 : key->len;
+    memcpy(w, key->addr, 16);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w[0] = __builtin_bswap64(w[0]);
+    w[1] = __builtin_bswap64(w[1]);
+#endif
+    w[2] = 0;
+    if (len < 64) {
+        w[0] &= len ? ~0ull << (64 - len) : 0;
+        w[1] = 0;
+    } else if (len < 128)
+        w[1] &= len > 64 ? ~0ull << (128 - len) : 0;
+    w[len / 64] |= 0x8000000000000000ull >> (len % 64);
+}
+
+static int bitops_lpm128(int req, void *key1, void *key2)
+{
+    uint64_t w1[3], w2[3];
+    int i;
+
+    lpm128_encode(key1, w1);
+    if (req >= 0)
+        return (w1[req / 64] << (req % 64)) >> 63;
+    lpm128_encode(key2, w2);
+    for (i = 0; i < 3; i++)
+        if (w1[i] != w2[i])
+            return i * 64 + __builtin_clzll(w1[i] ^ w2[i]);
+    return -1;
+}
+#endif
+
 /* vim: set syn=c.doxygen cin et sw=4 ts=4 tw=80 fo=croqmMj: */
@@ -15,22 +15,76 @@
 #ifndef _C3BT_H_
 #define _C3BT_H_
 
+#include <stddef.h>
 #include <stdint.h>
 typedef unsigned int uint;
 
-/* Or you may use <stdbool.h> */
+/* Or you may use <stdbool.h>.  C++ has its own, of the same size in GCC. */
+#ifndef __cplusplus
 typedef unsigned char bool;
 #define true    1
 #define false   0
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Enable this to keep 64B cells under LP64.  Cell references become 32-bit
+ * indices into a per-tree cell arena, and uobj references become 32-bit
+ * offsets, so uobjs must be 4B-aligned and lie within 8GB of the first uobj
+ * added.  It has no effect under LP32.
+ */
+/* #define C3BT_COMPRESSED */
+
+#if defined(C3BT_COMPRESSED) && !defined(_LP64)
+#undef C3BT_COMPRESSED
+#endif
+
+/*
+ * Cell geometry.  LP32 uses 64B cells with 8 nodes; LP64 uses 128B "wide"
+ * cells with 9 nodes (pointers are twice as large, and crit-bit numbers are
+ * 16-bit) unless references are compressed.
+ */
+#if defined(_LP64) && !defined(C3BT_COMPRESSED)
+#define C3BT_WIDE_CELL
+#define NODES_PER_CELL  9
+#define C3BT_CELL_SIZE  128
+#else
 #define NODES_PER_CELL  8
+#define C3BT_CELL_SIZE  64
+#endif
+
+/*
+ * Enable this to track node and pointer allocation with bitmaps, so that slot
+ * allocation and node counting are single ctz/popcount instructions.  The
+ * bitmaps use the spare bytes of the LP64 (wide) cell.
+ */
+/* #define C3BT_BITMAP */
+
+#if defined(C3BT_BITMAP) && !defined(C3BT_WIDE_CELL)
+#error "C3BT_BITMAP REQUIRES THE LP64 WIDE CELL."
+#endif
+
+/*
+ * Enable this to store the nodes of a cell as separate cbit, left child and
+ * right child arrays.  Cell-level searches (node parent, cell anchor, split
+ * point) then use SIMD compares when SSE2 or AVX2 is available.  Works with
+ * all the cell layouts above.
+ */
+/* #define C3BT_SOA */
+/*
+ * Enable this to back full-size cell slabs (or the compressed cell arena) by
+ * 2MB pages, to cut TLB misses on large trees.  Reserved huge pages are used
+ * if available, transparent huge pages otherwise.
+ */
+/* #define C3BT_HUGEPAGE */
 /*
  * Enable this to get statistics data of C3BT internals.
- * Note: these are global stats, not per-tree.
+ * Note: these are global stats, not per-tree.  They are updated atomically, so
+ * threads changing different trees at once (e.g. the shards of a sharded tree)
+ * all count in them; per-shard counts are in c3bt_sharded_stats().
  */
 #define C3BT_STATS
 
@@ -47,6 +101,11 @@ extern uint c3bt_stat_merges; /* cell merges. */
  */
 extern uint c3bt_stat_popdist[NODES_PER_CELL];
 #endif
+/*
+ * Enable this to also count the cells and cache lines touched by lookups.  It
+ * adds bookkeeping to every lookup, so it is off by default.
+ */
+/* #define C3BT_LOOKUP_STATS */
 
 /* Feature configurations. */
 #define C3BT_FEATURE_MAX
@@ -56,16 +115,44 @@ extern uint c3bt_stat_popdist[NODES_PER_CELL];
 #undef  C3BT_WITH_STRING
 #undef  C3BT_WITH_INTS
 #undef  C3BT_WITH_FLOATS
+#undef  C3BT_WITH_LPM
+#undef  C3BT_WITH_THREADS
 #elif defined(C3BT_FEATURE_COMMON)
-/* Minimal + string, 32 and 64 bit integers. */
+/* Minimal + string, 32 and 64 bit integers, parallel build. */
 #define C3BT_WITH_STRING
 #define C3BT_WITH_INTS
 #undef  C3BT_WITH_FLOATS
+#undef  C3BT_WITH_LPM
+#define C3BT_WITH_THREADS
 #elif defined(C3BT_FEATURE_MAX)
-/* Common + single and double precision floating point. */
+/* Common + single and double precision floating point, address prefixes. */
 #define C3BT_WITH_STRING
 #define C3BT_WITH_INTS
 #define C3BT_WITH_FLOATS
+#define C3BT_WITH_LPM
+#define C3BT_WITH_THREADS
+#endif
+
+#if defined(C3BT_WITH_FLOATS) && !defined(C3BT_WITH_INTS)
+#error "C3BT_WITH_FLOATS REQUIRES C3BT_WITH_INTS."
+#endif
+
+/*
+ * With threads, readers must not share a cache line they write, so the lookup
+ * counters are per thread: each thread reads back its own lookups.
+ */
+#ifdef C3BT_LOOKUP_STATS
+#ifdef C3BT_WITH_THREADS
+#define C3BT_STAT_TLS   __thread
+#else
+#define C3BT_STAT_TLS
+#endif
+/* tree lookups (find, locate, add). */
+extern C3BT_STAT_TLS uint64_t c3bt_stat_lookups;
+/* cells visited by lookups. */
+extern C3BT_STAT_TLS uint64_t c3bt_stat_lookup_cells;
+/* cache lines touched by lookups. */
+extern C3BT_STAT_TLS uint64_t c3bt_stat_lookup_lines;
 #endif
 
 /* 
@@ -74,8 +161,13 @@ extern uint c3bt_stat_popdist[NODES_PER_CELL];
  * For details please check c3bt_tree_impl in the source.
  */
 typedef struct c3bt_tree {
-    void *opaque1[2];
-    int opaque2[3];
+    void *opaque1[3];
+    int opaque2[2];
+    void *opaque3[2];
+    int opaque4[2];
+#ifdef C3BT_WITH_THREADS
+    void *opaque5;
+#endif
 } c3bt_tree;
 
 /*
@@ -86,9 +178,44 @@ typedef struct c3bt_tree {
  */
 typedef struct c3bt_cursor {
     void *opaque1;
+#ifdef _LP64
+    int16_t opaque2[4];
+#else
     int16_t opaque2[2];
+#endif
 } c3bt_cursor;
 
+#ifdef C3BT_WITH_LPM
+/*
+ * Address prefix keys: the first len bits of addr.  Address bits past len are
+ * ignored.  Prefixes sort as the bit strings addr[0, len) "1" "0...", so a
+ * prefix comes before the longer prefixes it covers, and /0 is a valid key.
+ */
+typedef struct c3bt_prefix32 {
+    uint32_t addr; /* host order: 10.0.0.0 is 0x0A000000. */
+    uint32_t len; /* 0 to 32. */
+} c3bt_prefix32;
+
+typedef struct c3bt_prefix128 {
+    uint8_t addr[16]; /* network order. */
+    uint32_t len; /* 0 to 128. */
+} c3bt_prefix128;
+#endif
+
+#ifdef C3BT_WITH_STRING
+/*
+ * BLOB key: a binary string of any bytes, NULs included, by pointer and
+ * length.  Blobs sort bytewise, and a blob sorts before the longer ones it is
+ * a prefix of.  Each byte takes 9 key bits (a "more" bit, then the byte) and
+ * the end 1, so kbits=0 allows up to 7281 bytes in the default layout or 28
+ * with C3BT_COMPRESSED.
+ */
+typedef struct c3bt_blob {
+    const void *data;
+    size_t len;
+} c3bt_blob;
+#endif
+
 enum c3bt_key_datatypes {
     /* BITS: fixed-length bit string. */
     C3BT_KDT_BITS = 0,
@@ -96,11 +223,29 @@ enum c3bt_key_datatypes {
     /*
      * PSTR: the key is a pointer to a zero-terminated string.
      * STR: the key is a zero-terminated string.
+     * BLOB: the key is a c3bt_blob.
+     * PHSTR, HSTR: as PSTR and STR, but strings may be longer than the key
+     * bits: past the first (key bits - 64) / 8 bytes (24 with
+     * C3BT_COMPRESSED, 8184 otherwise), the rest is ordered by its 64-bit
+     * hash.  kbits is ignored.  Strings that share the head and the hash
+     * can't be told apart, so only one of them can be added.
      */
-    C3BT_KDT_PSTR, C3BT_KDT_STR,
+    C3BT_KDT_PSTR, C3BT_KDT_STR, C3BT_KDT_BLOB,
+    C3BT_KDT_PHSTR, C3BT_KDT_HSTR,
 #endif
 #ifdef C3BT_WITH_INTS
     C3BT_KDT_U32, C3BT_KDT_S32, C3BT_KDT_U64, C3BT_KDT_S64,
+#endif
+#ifdef C3BT_WITH_FLOATS
+    /*
+     * F32, F64: float and double, in numeric order.  -0 and +0 are the same
+     * key; all NaNs are one key, after +inf.
+     */
+    C3BT_KDT_F32, C3BT_KDT_F64,
+#endif
+#ifdef C3BT_WITH_LPM
+    /* LPM32, LPM128: address prefixes, see c3bt_prefix32 and c3bt_lpm(). */
+    C3BT_KDT_LPM32, C3BT_KDT_LPM128,
 #endif
     C3BT_KDT_CUSTOM,
 };
@@ -142,9 +287,19 @@ extern bool c3bt_destroy(c3bt_tree *tree);
 /*
  * Get the number of user objects being indexed by the tree.
  *
- * Return 0 if tree is null.
+ * Return 0 if tree is null.  The count is 64-bit under LP64.
  */
-extern uint c3bt_nobjects(c3bt_tree *tree);
+extern size_t c3bt_nobjects(c3bt_tree *tree);
+
+/*
+ * Move all cells of the tree into fresh, contiguous storage, each cell's
+ * sub-cells placed next to each other, followed by their subtrees depth-first
+ * in key order.  Lookups then cross fewer pages, and a full scan reads memory
+ * mostly sequentially.  All cursors are invalidated.
+ *
+ * Return true if successful; false if no memory (the tree is left as is).
+ */
+extern bool c3bt_relayout(c3bt_tree *tree);
 
 /*
  * Add an user object to the C3BT index.
@@ -153,6 +308,30 @@ extern uint c3bt_nobjects(c3bt_tree *tree);
  */
 extern bool c3bt_add(c3bt_tree *tree, void *uobj);
 
+/*
+ * Build the index of n user objects at once.  uobjs must be sorted by key in
+ * ascending order, without duplicates, and the tree must be empty.  Cells are
+ * made bottom-up and filled as much as the key distribution allows, which is
+ * much faster and denser than adding the objects one by one.
+ *
+ * Return true if successful; false if the tree isn't empty, the array isn't
+ * strictly sorted, or no memory (the tree is left empty).
+ */
+extern bool c3bt_build_sorted(c3bt_tree *tree, void **uobjs, size_t n);
+
+#ifdef C3BT_WITH_THREADS
+/*
+ * Same as above, but uobjs needn't be sorted: it's sorted in place, then the
+ * tree is built, both on nthreads threads (all online CPUs if nthreads <= 0).
+ * Needs n pointers of temporary memory.  The result is the same tree as
+ * c3bt_build_sorted() makes.
+ *
+ * Return true if successful; false if the tree isn't empty, there are
+ * duplicates, or no memory (the tree is left empty).
+ */
+extern bool c3bt_build(c3bt_tree *tree, void **uobjs, size_t n, int nthreads);
+#endif
+
 /*
  * Remove an user object from the C3BT index.
  *
@@ -173,9 +352,14 @@ extern void *c3bt_find_bits(c3bt_tree *tree, uint8_t *key);
  * Find a zero-terminated string by value.
  *
  * Return the user object pointer when found, otherwise NULL.  This function
- * supports both STR and PSTR.
+ * supports STR, PSTR, HSTR and PHSTR.
  */
 extern void *c3bt_find_str(c3bt_tree *tree, char *key);
+
+/*
+ * Find a BLOB key by value, given as the bytes at ptr and their number.
+ */
+extern void *c3bt_find_blob(c3bt_tree *tree, const void *ptr, size_t len);
 #endif
 
 #ifdef C3BT_WITH_INTS
@@ -192,6 +376,47 @@ extern void *c3bt_find_u64(c3bt_tree *tree, uint64_t key);
 extern void *c3bt_find_s64(c3bt_tree *tree, int64_t key);
 #endif
 
+#ifdef C3BT_WITH_FLOATS
+/*
+ * Find by a float or double key; same as the integer ones.
+ */
+extern void *c3bt_find_f32(c3bt_tree *tree, float key);
+extern void *c3bt_find_f64(c3bt_tree *tree, double key);
+#endif
+
+#ifdef C3BT_WITH_LPM
+/*
+ * Longest-prefix match in a LPM32 or LPM128 tree.
+ *
+ * addr points to an uint32_t (host order) or to 16 bytes (network order).
+ * Return the user object with the longest prefix covering addr, or NULL.
+ */
+extern void *c3bt_lpm(c3bt_tree *tree, void *addr);
+#endif
+
+/*
+ * Find many keys at once.  keys[i] points to a key laid out as in the user
+ * objects (for PSTR, to a string pointer); results[i] receives the user object
+ * with that key, or NULL.  The lookups are interleaved and the memory they
+ * need is prefetched ahead, so their cache misses overlap.  Worth it from a few
+ * dozen keys on.
+ *
+ * Return the number of keys found.
+ */
+extern size_t c3bt_find_batch(c3bt_tree *tree, void **keys, size_t n,
+    void **results);
+
+/*
+ * Same as c3bt_find_batch(), but walks the tree once for all the keys, like a
+ * merge-join: each key resumes the descent from the deepest node it shares
+ * with the previous key's path instead of from the root.  Keys in any order
+ * give correct results, sorted keys give the most sharing.
+ *
+ * Return the number of keys found.
+ */
+extern size_t c3bt_find_sorted(c3bt_tree *tree, void **keys, size_t n,
+    void **results);
+
 /*
  * Locate an user object in the tree.
  *
@@ -245,6 +470,272 @@ extern void *c3bt_next(c3bt_tree *tree, c3bt_cursor *cur);
  */
 extern void *c3bt_prev(c3bt_tree *tree, c3bt_cursor *cur);
 
+/*
+ * Seek by key.
+ *
+ * key points to a key laid out as in the user objects (for custom bitops, an
+ * user object).  Return the user object with the lowest key >= key
+ * (lower_bound, the "ceiling"), the lowest key > key (upper_bound) or the
+ * highest key <= key (floor), and set the cursor (if cur is not NULL) to it for
+ * further iteration.  NULL is returned if there is no such object, and cursor
+ * becomes undefined.
+ */
+extern void *c3bt_lower_bound(c3bt_tree *tree, void *key, c3bt_cursor *cur);
+extern void *c3bt_upper_bound(c3bt_tree *tree, void *key, c3bt_cursor *cur);
+extern void *c3bt_floor(c3bt_tree *tree, void *key, c3bt_cursor *cur);
+
+/*
+ * Bounded range iterator.
+ */
+typedef struct c3bt_range {
+    c3bt_cursor cur;
+    void *next; /* the user object to return next, at cur. */
+    void *last; /* the last user object of the range, or NULL. */
+} c3bt_range;
+
+/*
+ * Return the first user object with lo <= key <= hi and set up the range for
+ * c3bt_range_next().  lo or hi as NULL leaves that side unbounded.  Keys are
+ * given as for c3bt_lower_bound().  NULL is returned if the range is empty.
+ */
+extern void *c3bt_range_first(c3bt_tree *tree, void *lo, void *hi,
+    c3bt_range *range);
+
+/*
+ * Return the next user object in the range, or NULL past its end.  The tree
+ * must not be modified between the calls.
+ */
+extern void *c3bt_range_next(c3bt_tree *tree, c3bt_range *range);
+
+/*
+ * Return the first user object whose key starts with the first nbits of
+ * prefix, and set up the range to enumerate the others with c3bt_range_next().
+ * prefix is given as a key (for STR a string, for PSTR a pointer to one, for
+ * BITS at least (nbits + 7) / 8 bytes); for strings nbits is usually 8 *
+ * strlen(prefix).  NULL is returned if no key has the prefix.
+ *
+ * Only the subtree holding the prefix is visited.
+ */
+extern void *c3bt_prefix_first(c3bt_tree *tree, void *prefix, uint nbits,
+    c3bt_range *range);
+
+#ifdef C3BT_WITH_THREADS
+/*
+ * Concurrent readers with a single writer.
+ *
+ * After c3bt_rcu_enable(), one thread may add and remove while up to nreaders
+ * others look up, each between c3bt_read_lock() and c3bt_read_unlock() with
+ * its own reader number (0 to nreaders - 1).  Readers take no lock: the
+ * writer copies the cells it changes and links the copies in with one atomic
+ * store, and the old cells are freed once no reader that might see them is
+ * left in its read-side section.  Lookups see the tree before or after each
+ * change, never in between.
+ *
+ * Covered on the reader side: c3bt_find_*(), c3bt_find_batch/sorted(),
+ * c3bt_locate() (the cursor is only good for c3bt_remove() by the writer) and
+ * c3bt_lpm().  Cursor iteration, seeks and ranges need the tree to hold still.
+ * Building, relayout and destroy must wait until no reader is in a section.
+ * The writer side is otherwise unchanged, but c3bt_remove() may now also fail
+ * if there's no memory.  Sections are cheap (a store and a fence) and may
+ * cover many lookups, but the longer they are, the longer old cells are kept.
+ *
+ * Return false if already enabled or no memory.
+ */
+extern bool c3bt_rcu_enable(c3bt_tree *tree, int nreaders);
+extern void c3bt_read_lock(c3bt_tree *tree, int reader);
+extern void c3bt_read_unlock(c3bt_tree *tree, int reader);
+
+/*
+ * Concurrent writers.
+ *
+ * After c3bt_rcu_enable(), let nwriters threads add and remove at once, each
+ * with its own writer number (0 to nwriters - 1) in c3bt_add_mt() and
+ * c3bt_remove_mt(); c3bt_add() and c3bt_remove() are writer 0.  Call it before
+ * the threads start.  A change locks only the cells it copies and their
+ * parents, so writers in different parts of the tree don't wait for each
+ * other; readers are as above.  Writers need no read-side sections.  As with
+ * lookups, an uobj removed by one writer may still be looked at by the others
+ * until they return.
+ *
+ * Return false if not enabled for readers, already done, or no memory.
+ */
+extern bool c3bt_rcu_writers(c3bt_tree *tree, int nwriters);
+extern bool c3bt_add_mt(c3bt_tree *tree, void *uobj, int writer);
+extern bool c3bt_remove_mt(c3bt_tree *tree, void *uobj, int writer);
+
+/*
+ * Sharded trees.
+ *
+ * A sharded tree splits the key space on the first shard_bits key bits into
+ * 2^shard_bits independent trees, each with its own lock, so threads working
+ * on keys of different shards don't wait for each other.  Shard s holds the
+ * keys whose first bits are s, so the shards are in key order and ordered
+ * iteration and seeks work across them.  There's no hashing, hence also no
+ * balancing: the keys should spread over their first bits (string keys, for
+ * one, mostly don't; integers spread if they use the whole range).
+ */
+typedef struct c3bt_sharded c3bt_sharded;
+
+typedef struct c3bt_shard_cursor {
+    c3bt_cursor cur;
+    int shard;
+    int reserved;
+} c3bt_shard_cursor;
+
+typedef struct c3bt_shard_stats {
+    uint64_t nobjects;
+    uint64_t adds; /* successful adds, batches included. */
+    uint64_t removes; /* successful removes. */
+    uint64_t finds; /* lookups, found or not. */
+    uint64_t waits; /* times the lock was busy. */
+} c3bt_shard_stats;
+
+/*
+ * Create a sharded tree; kdt, koffset and kbits are as for c3bt_init(), and
+ * shard_bits is 0 to 16 (8 with C3BT_COMPRESSED, as each shard reserves its own
+ * cell arena), but no more than the key bits.  Return NULL if invalid or no
+ * memory.
+ */
+extern c3bt_sharded *c3bt_sharded_new(uint kdt, uint koffset, uint kbits,
+    int shard_bits);
+extern void c3bt_sharded_free(c3bt_sharded *sh);
+extern int c3bt_sharded_nshards(c3bt_sharded *sh);
+/* The shard of a key, given as for c3bt_lower_bound(). */
+extern int c3bt_sharded_shard_of(c3bt_sharded *sh, void *key);
+/*
+ * The tree of a shard, to use directly while no other thread uses the shard
+ * (e.g. the typed c3bt_find_*() when the shard is known to hold still).
+ */
+extern c3bt_tree *c3bt_sharded_tree(c3bt_sharded *sh, int shard);
+extern size_t c3bt_sharded_nobjects(c3bt_sharded *sh);
+extern bool c3bt_sharded_stats(c3bt_sharded *sh, int shard,
+    c3bt_shard_stats *stats);
+
+/*
+ * Add, remove and find under the lock of the shard; any thread may call them
+ * at any time.  find() takes a key as c3bt_lower_bound() does and returns the
+ * user object with that key, or NULL.
+ */
+extern bool c3bt_sharded_add(c3bt_sharded *sh, void *uobj);
+extern bool c3bt_sharded_remove(c3bt_sharded *sh, void *uobj);
+extern void *c3bt_sharded_find(c3bt_sharded *sh, void *key);
+
+/*
+ * Ordered iteration and seeks over all the shards, as c3bt_first() etc.  They
+ * take no lock: the shards visited must hold still.
+ */
+extern void *c3bt_sharded_first(c3bt_sharded *sh, c3bt_shard_cursor *cur);
+extern void *c3bt_sharded_last(c3bt_sharded *sh, c3bt_shard_cursor *cur);
+extern void *c3bt_sharded_next(c3bt_sharded *sh, c3bt_shard_cursor *cur);
+extern void *c3bt_sharded_prev(c3bt_sharded *sh, c3bt_shard_cursor *cur);
+extern void *c3bt_sharded_lower_bound(c3bt_sharded *sh, void *key,
+    c3bt_shard_cursor *cur);
+extern void *c3bt_sharded_upper_bound(c3bt_sharded *sh, void *key,
+    c3bt_shard_cursor *cur);
+extern void *c3bt_sharded_floor(c3bt_sharded *sh, void *key,
+    c3bt_shard_cursor *cur);
+
+/*
+ * Per-shard parallel bulk operations, on nthreads threads (all online CPUs if
+ * nthreads <= 0, at most one per shard).  Thread t works on shards t, t +
+ * nthreads, ... under their locks.
+ *
+ * add_batch() adds n uobjs; an empty shard is built in one go as by
+ * c3bt_build().  Return the number added: duplicates (and uobjs that find no
+ * memory) are skipped.  Needs n pointers of temporary memory; 0 if there's
+ * none.
+ *
+ * apply() calls fn(tree, shard, arg) on every shard.
+ */
+extern size_t c3bt_sharded_add_batch(c3bt_sharded *sh, void **uobjs, size_t n,
+    int nthreads);
+extern void c3bt_sharded_apply(c3bt_sharded *sh,
+    void (*fn)(c3bt_tree *tree, int shard, void *arg), void *arg,
+    int nthreads);
+
+/*
+ * Optional thread-to-shard affinity.  When on, the threads of the bulk
+ * operations are pinned, thread t to the t-th CPU (modulo the number of CPUs
+ * the process may run on), so with the same nthreads each shard is always
+ * worked on by the same CPU and stays in its caches.  c3bt_sharded_pin() pins
+ * the calling thread to the CPU that works on a shard in bulk operations with
+ * nthreads threads, for threads that mostly work on that shard.  Return false
+ * if the shard is invalid or the pinning fails.
+ */
+extern void c3bt_sharded_affinity(c3bt_sharded *sh, bool on);
+extern bool c3bt_sharded_pin(c3bt_sharded *sh, int shard, int nthreads);
+
+/*
+ * Flat combining.
+ *
+ * A combiner is a front-end to one tree for up to nslots threads that add and
+ * remove in short bursts, each with its own slot number (0 to nslots - 1),
+ * instead of taking a lock around c3bt_add() and c3bt_remove().  A thread
+ * posts its op in its slot; one of the waiting threads becomes the combiner
+ * and applies all the posted ops in key order, so the lock and the cells stay
+ * in one cache while others would take turns.  The combiner is the one writer
+ * of the tree, so c3bt_rcu_enable() readers may look up meanwhile; nothing
+ * else may change the tree while the combiner is in use.
+ *
+ * c3bt_combine_add() and c3bt_combine_remove() return as c3bt_add() and
+ * c3bt_remove() do, once the op is done.
+ */
+typedef struct c3bt_combiner c3bt_combiner;
+
+/* Return NULL if no memory. */
+extern c3bt_combiner *c3bt_combiner_new(c3bt_tree *tree, int nslots);
+extern void c3bt_combiner_free(c3bt_combiner *fc);
+extern bool c3bt_combine_add(c3bt_combiner *fc, void *uobj, int slot);
+extern bool c3bt_combine_remove(c3bt_combiner *fc, void *uobj, int slot);
+
+/*
+ * NUMA replicas.
+ *
+ * A replicated tree keeps one copy of the cells per NUMA node (nreplicas <= 0)
+ * or nreplicas copies, the CPUs of node n using replica n % nreplicas; the
+ * uobjs are shared.  Writes go to an operation log and are applied to the
+ * writer's local replica at once, and to the others by the next thread on
+ * their node that reads or writes, so that their cells are allocated (first
+ * touched) by that node; with sync, a write is applied to all replicas
+ * before it returns.  Writes are serialized; any thread may write at any
+ * time.  Each replica is enabled for nreaders RCU readers.
+ *
+ * c3bt_replicated_read_lock() brings the local replica (or the given one, if
+ * replica >= 0) up to date and returns its tree for the c3bt_find_*() etc.
+ * covered by c3bt_read_lock(), until c3bt_replicated_read_unlock().  Readers
+ * see all writes done before the read lock.
+ *
+ * A write is logged only if it succeeded on the writer's replica.  Should a
+ * replica run out of memory replaying one, it stays at the write before, which
+ * is retried at its next catch up; meanwhile c3bt_replicated_read_lock()
+ * returns NULL for it (another replica may be given), c3bt_replicated_sync()
+ * returns false, and writes fail once the log is full of writes it hasn't
+ * applied.
+ *
+ * A removed uobj may still be looked at in replicas not yet up to date; after
+ * c3bt_replicated_sync() it's as with c3bt_rcu_enable().
+ *
+ * new() returns NULL if nreaders isn't positive or no memory.
+ */
+typedef struct c3bt_replicated c3bt_replicated;
+
+extern c3bt_replicated *c3bt_replicated_new(uint kdt, uint koffset,
+    uint kbits, int nreplicas, int nreaders, bool sync);
+extern void c3bt_replicated_free(c3bt_replicated *rp);
+extern int c3bt_replicated_nreplicas(c3bt_replicated *rp);
+/* The replica of the calling thread's CPU. */
+extern int c3bt_replicated_local(c3bt_replicated *rp);
+/* The tree of a replica, for use while no one writes or reads. */
+extern c3bt_tree *c3bt_replicated_tree(c3bt_replicated *rp, int replica);
+extern bool c3bt_replicated_add(c3bt_replicated *rp, void *uobj);
+extern bool c3bt_replicated_remove(c3bt_replicated *rp, void *uobj);
+/* Bring all replicas up to date; return false if one couldn't be. */
+extern bool c3bt_replicated_sync(c3bt_replicated *rp);
+extern c3bt_tree *c3bt_replicated_read_lock(c3bt_replicated *rp, int reader,
+    int replica);
+extern void c3bt_replicated_read_unlock(c3bt_replicated *rp, int reader);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
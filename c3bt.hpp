@@ -0,0 +1,271 @@
+/*
+ * C3BT: Compact Clustered Crit-Bit Tree
+ *
+ * Copyright (c) 2012, 2013 Ling LI <lix2ng@gmail.com>
+ *
+ * TERMS OF USE:
+ *   1. Do not remove the copyright notice above and this terms of use.
+ *   2. You do not need to mention your use of this code, but when you do,
+ *      call it "C3BT".
+ *   3. This code is provided "as is" and the author disclaims liability for
+ *      any consequence caused by this code itself or any larger work that
+ *      incorporates it.
+ */
+
+/*
+ * C++ front-end.  Header only, C++11.
+ *
+ * c3bt::tree<T, Key, KeyTraits> indexes objects of type T by a Key member, with
+ * typed find() and bidirectional iterators.  The key type is bound at compile
+ * time by KeyTraits: for the builtin types, find() goes straight to the
+ * type-specific lookup (integers don't call bitops at all), and the calls
+ * inline down to the C API.  The cell algorithms and the cell layout are the C
+ * ones: the layout is fixed when c3bt.c is built (see the options in c3bt.h),
+ * so it is not a template parameter.
+ *
+ * Custom keys: derive the traits from c3bt::custom_key_traits and give them a
+ * static bitops function with the C signature; the key is then the whole
+ * object, as with c3bt_init_bitops().
+ */
+
+#ifndef _C3BT_HPP_
+#define _C3BT_HPP_
+
+#include <cstddef>
+#include <iterator>
+#include "c3bt.h"
+
+namespace c3bt {
+
+/* Traits of the builtin key types: how to init a tree and find a key. */
+template <typename Key>
+struct key_traits;
+
+#ifdef C3BT_WITH_INTS
+template <>
+struct key_traits<uint32_t> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_U32, koffset, 0); }
+    static void *find(c3bt_tree *tree, uint32_t key)
+    { return c3bt_find_u32(tree, key); }
+};
+
+template <>
+struct key_traits<int32_t> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_S32, koffset, 0); }
+    static void *find(c3bt_tree *tree, int32_t key)
+    { return c3bt_find_s32(tree, key); }
+};
+
+template <>
+struct key_traits<uint64_t> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_U64, koffset, 0); }
+    static void *find(c3bt_tree *tree, uint64_t key)
+    { return c3bt_find_u64(tree, key); }
+};
+
+template <>
+struct key_traits<int64_t> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_S64, koffset, 0); }
+    static void *find(c3bt_tree *tree, int64_t key)
+    { return c3bt_find_s64(tree, key); }
+};
+#endif
+
+#ifdef C3BT_WITH_FLOATS
+template <>
+struct key_traits<float> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_F32, koffset, 0); }
+    static void *find(c3bt_tree *tree, float key)
+    { return c3bt_find_f32(tree, key); }
+};
+
+template <>
+struct key_traits<double> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_F64, koffset, 0); }
+    static void *find(c3bt_tree *tree, double key)
+    { return c3bt_find_f64(tree, key); }
+};
+#endif
+
+#ifdef C3BT_WITH_STRING
+/* The member is a pointer to a zero-terminated string (PSTR). */
+template <>
+struct key_traits<const char *> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_PSTR, koffset, 0); }
+    static void *find(c3bt_tree *tree, const char *key)
+    { return c3bt_find_str(tree, const_cast<char*>(key)); }
+};
+
+template <>
+struct key_traits<c3bt_blob> {
+    static bool init(c3bt_tree *tree, size_t koffset)
+    { return c3bt_init(tree, C3BT_KDT_BLOB, koffset, 0); }
+    static void *find(c3bt_tree *tree, const c3bt_blob &key)
+    { return c3bt_find_blob(tree, key.data, key.len); }
+};
+#endif
+
+/*
+ * Base of the traits of custom keys.  Traits must provide
+ *     static int bitops(int req, void *uobj1, void *uobj2);
+ * and find() takes an object with the key to look for.
+ */
+template <typename Traits>
+struct custom_key_traits {
+    static bool init(c3bt_tree *tree, size_t)
+    { return c3bt_init_bitops(tree, Traits::bitops); }
+    template <typename T>
+    static void *find(c3bt_tree *tree, const T &key)
+    {
+        c3bt_cursor cur;
+
+        return c3bt_locate(tree, const_cast<T*>(&key), &cur);
+    }
+};
+
+template <typename T, typename Key = T, typename KeyTraits = key_traits<Key> >
+class tree {
+public:
+    class iterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef T *pointer;
+        typedef T &reference;
+
+        iterator() : tree_(nullptr), obj_(nullptr) {}
+        T &operator*() const { return *obj_; }
+        T *operator->() const { return obj_; }
+        T *get() const { return obj_; }
+        iterator &operator++()
+        {
+            obj_ = static_cast<T*>(c3bt_next(tree_, &cur_));
+            return *this;
+        }
+        iterator operator++(int) { iterator i = *this; ++*this; return i; }
+        /* end() steps back to the last object. */
+        iterator &operator--()
+        {
+            obj_ = static_cast<T*>(obj_ ? c3bt_prev(tree_, &cur_)
+                : c3bt_last(tree_, &cur_));
+            return *this;
+        }
+        iterator operator--(int) { iterator i = *this; --*this; return i; }
+        bool operator==(const iterator &i) const { return obj_ == i.obj_; }
+        bool operator!=(const iterator &i) const { return obj_ != i.obj_; }
+
+    private:
+        friend class tree;
+        explicit iterator(c3bt_tree *tree) : tree_(tree), obj_(nullptr) {}
+
+        c3bt_tree *tree_;
+        c3bt_cursor cur_;
+        T *obj_;
+    };
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    /*
+     * koffset: offsetof(T, key member); ignored for custom keys.  Check ok()
+     * after constructing: if the key type can't be set up (not built into
+     * c3bt.c, say), the tree stays empty: adds and builds fail.
+     */
+    explicit tree(size_t koffset = 0)
+        : tree_(), ok_(KeyTraits::init(&tree_, koffset)) {}
+    ~tree() { if (ok_) c3bt_destroy(&tree_); }
+    tree(const tree &) = delete;
+    tree &operator=(const tree &) = delete;
+
+    bool ok() const { return ok_; }
+    explicit operator bool() const { return ok_; }
+
+    bool add(T *obj) { return ok_ && c3bt_add(&tree_, obj); }
+    bool remove(T *obj) { return c3bt_remove(&tree_, obj); }
+    bool build_sorted(T **objs, size_t n)
+    {
+        return ok_ && c3bt_build_sorted(&tree_, reinterpret_cast<void**>(objs),
+            n);
+    }
+#ifdef C3BT_WITH_THREADS
+    bool build(T **objs, size_t n, int nthreads = 0)
+    {
+        return ok_ && c3bt_build(&tree_, reinterpret_cast<void**>(objs), n,
+            nthreads);
+    }
+#endif
+    bool relayout() { return c3bt_relayout(&tree_); }
+
+    size_t size() const { return c3bt_nobjects(handle()); }
+    bool empty() const { return size() == 0; }
+
+    template <typename K>
+    T *find(const K &key) const
+    { return static_cast<T*>(KeyTraits::find(handle(), key)); }
+    /* keys[i] points to a Key; see c3bt_find_batch/sorted(). */
+    size_t find_batch(const Key *const *keys, size_t n, T **results) const
+    {
+        return c3bt_find_batch(handle(), const_cast<void**>(
+            reinterpret_cast<const void *const *>(keys)), n,
+            reinterpret_cast<void**>(results));
+    }
+    size_t find_sorted(const Key *const *keys, size_t n, T **results) const
+    {
+        return c3bt_find_sorted(handle(), const_cast<void**>(
+            reinterpret_cast<const void *const *>(keys)), n,
+            reinterpret_cast<void**>(results));
+    }
+
+    iterator locate(const T *obj) const
+    {
+        iterator i(handle());
+
+        i.obj_ = static_cast<T*>(c3bt_locate(handle(), const_cast<T*>(obj),
+            &i.cur_));
+        return i;
+    }
+    /* Seek by key, see c3bt_lower_bound() etc.; end() if there's none. */
+    iterator lower_bound(const Key &key) const
+    { return seek(c3bt_lower_bound, key); }
+    iterator upper_bound(const Key &key) const
+    { return seek(c3bt_upper_bound, key); }
+    iterator floor(const Key &key) const { return seek(c3bt_floor, key); }
+    iterator begin() const
+    {
+        iterator i(handle());
+
+        i.obj_ = static_cast<T*>(c3bt_first(handle(), &i.cur_));
+        return i;
+    }
+    iterator end() const { return iterator(handle()); }
+    reverse_iterator rbegin() const { return reverse_iterator(end()); }
+    reverse_iterator rend() const { return reverse_iterator(begin()); }
+
+    c3bt_tree *handle() const { return const_cast<c3bt_tree*>(&tree_); }
+
+private:
+    iterator seek(void *(*fn)(c3bt_tree *, void *, c3bt_cursor *),
+        const Key &key) const
+    {
+        iterator i(handle());
+
+        i.obj_ = static_cast<T*>(fn(handle(), const_cast<Key*>(&key),
+            &i.cur_));
+        return i;
+    }
+
+    c3bt_tree tree_;
+    bool ok_;
+};
+
+} /* namespace c3bt */
+
+#endif /*_C3BT_HPP_*/
+
+/* vim: set syn=cpp.doxygen cin et sw=4 ts=4 tw=80 fo=croqmMj: */